@@ -0,0 +1,39 @@
+#!/bin/sh
+# Renders every highlight state for a set of radius, outline, and render
+# mode combinations under Xvfb and compares the screen contents with the
+# reference images in references/. With --update, the references are
+# written instead, to be checked in after a deliberate rendering change.
+
+cd "$(dirname "$0")" || exit 1
+binary=./highlight-pointer
+mode=--compare-sprites
+if [ "$1" = "--update" ]; then
+    mode=--dump-sprites
+elif [ ! -d references ]; then
+    echo "SKIP: no references yet, write them with '$0 --update' using a trusted build and check them in" >&2
+    exit 0
+fi
+
+if [ -z "$CHECK_RENDERING_XVFB" ]; then
+    CHECK_RENDERING_XVFB=1 exec ./xvfb.sh "$0" "$@"
+fi
+
+failed=0
+for radius in 5 10 30; do
+    for outline in 0 1 3; do
+        # overlay draws into the Composite overlay window, as there is no compositor
+        for render in window overlay; do
+            name=r$radius-o$outline-$render
+            flags="-r $radius -o $outline"
+            if [ $render = overlay ]; then
+                flags="$flags --overlay"
+            fi
+            if [ $mode = --dump-sprites ]; then
+                mkdir -p "references/$name"
+            fi
+            echo "$name:"
+            $binary $flags $mode "references/$name" || failed=1
+        done
+    done
+done
+exit $failed
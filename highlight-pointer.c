@@ -27,23 +27,79 @@
   SOFTWARE.
 */
 
+#define _GNU_SOURCE
+
 #include <X11/Xatom.h>
+#include <X11/Xft/Xft.h>
 #include <X11/Xlib.h>
 #include <X11/Xmd.h>
 #include <X11/extensions/XInput2.h>
+#include <X11/extensions/XRes.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/Xcomposite.h>
 #include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xrender.h>
 #include <X11/extensions/shape.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <png.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/tcp.h>
+#endif
 
 #define TARGET_FPS 0
 
+#ifdef CHECK_ALLOCATIONS
+/* heap use is counted while synthetic input is processed, see check_allocations() */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static int counting_allocations = 0;
+static unsigned long allocation_count = 0;
+static unsigned long free_count = 0;
+
+void* malloc(size_t size) {
+    allocation_count += counting_allocations;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+    allocation_count += counting_allocations;
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    allocation_count += counting_allocations;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    if (ptr) {
+        free_count += counting_allocations;
+    }
+    __libc_free(ptr);
+}
+#endif
+
 static Display* dpy;
 static GC gc = 0;
 static Window win;
@@ -63,7 +119,7 @@ static struct {
 };
 
 #define KEY_OPTION_OFFSET 1000
-#define KEY_ARRAY_SIZE 5
+#define KEY_ARRAY_SIZE 7
 struct {
     KeySym keysym;
     unsigned int modifiers;
@@ -77,30 +133,405 @@ struct {
 #define KEY_TOGGLE_AUTOHIDE_CURSOR 3
     {NoSymbol, 0},
 #define KEY_TOGGLE_AUTOHIDE_HIGHLIGHT 4
+    {NoSymbol, 0},
+#define KEY_DUMP_FLIGHT_RECORDER 5
+    {NoSymbol, 0},
+#define KEY_CYCLE_PRESET 6
     {NoSymbol, 0}};
 
 static unsigned int numlockmask = 0;
 
-static XColor pressed_color;
-static XColor released_color;
-static int button_pressed = 0;
+#define COLOR_OPTION_OFFSET 2000
+#define SCROLL_LEVELS 4
+#define PEN_LEVELS 4 /* sizes shown for pen pressure */
+#define PEN_CONTACT_PRESSURE 0.02 /* relative pressure from which the pen counts as touching */
+#define PEN_HOVER_OUTLINE 2
+#define STATE_RELEASED 0
+#define STATE_PRESSED 1 /* any other button */
+#define STATE_LEFT 2
+#define STATE_MIDDLE 3
+#define STATE_RIGHT 4
+#define STATE_CTRL 5
+#define STATE_SHIFT 6
+/* scroll states, each followed by SCROLL_LEVELS - 1 states of increasing intensity */
+#define STATE_SCROLL_UP 7
+#define STATE_SCROLL_DOWN (STATE_SCROLL_UP + SCROLL_LEVELS)
+#define STATE_SCROLL_LEFT (STATE_SCROLL_DOWN + SCROLL_LEVELS)
+#define STATE_SCROLL_RIGHT (STATE_SCROLL_LEFT + SCROLL_LEVELS)
+/* pen hovering, and touching followed by PEN_LEVELS - 1 states of increasing pressure and size */
+#define STATE_PEN_HOVER (STATE_SCROLL_RIGHT + SCROLL_LEVELS)
+#define STATE_PEN_CONTACT (STATE_PEN_HOVER + 1)
+#define STATE_COUNT (STATE_PEN_CONTACT + PEN_LEVELS)
+/* pre-rendered highlight look per state, set as window background and shape */
+static struct state {
+    XColor color;
+    Pixmap pixmap;
+    Pixmap mask; /* None for dot_mask */
+    Picture picture;          /* only for RENDER_LAYER */
+    Picture mask_picture;     /* only for RENDER_LAYER */
+    unsigned long last_used; /* for LRU eviction of pixmap */
+} states[STATE_COUNT];
+static unsigned long state_clock = 0;
+static int sprite_radius; /* sprites, masks, and highlight window are 2 * sprite_radius + 2 wide */
+static int xres_available = 0;
+static XID client_xid; /* any ID of this client, for X-Resource queries */
+
+typedef float v4sf __attribute__((vector_size(16)));
+
+/* layers of --style, compiled into style_sprites */
+#define STYLE_LAYERS 16
+#define IMAGE_MIPS 12 /* halvings of images, down to 1 pixel for up to 2048 pixels */
+#define LAYER_FILL 0
+#define LAYER_RING 1
+#define LAYER_GLOW 2
+#define LAYER_SHADOW 3
+#define LAYER_IMAGE 4
+#define LAYER_TYPES 5
+static const char* layer_names[LAYER_TYPES] = {"fill", "ring", "glow", "shadow", "image"};
+static struct style_layer {
+    int type;
+    double radius; /* in pixels, before scaling for pen pressure */
+    double width;  /* of ring, glow, or shadow blur */
+    double offset_x;
+    double offset_y;
+    double alpha;
+    char* color_string;
+    char* color_strings[STATE_COUNT]; /* per color option, NULL for color_string */
+    /* for LAYER_IMAGE, premultiplied RGBA at full, half, quarter, ... size */
+    v4sf* mips[IMAGE_MIPS];
+    int mip_widths[IMAGE_MIPS];
+    int mip_heights[IMAGE_MIPS];
+    int mip_count;
+} style_layers[STYLE_LAYERS];
+static int style_layer_count = 0;
+static unsigned char* style_sprites = NULL; /* premultiplied RGBA per state, or NULL without style */
+static const char* color_option_names[STATE_COUNT] = {[STATE_RELEASED] = "released", [STATE_PRESSED] = "pressed", [STATE_LEFT] = "left",
+                                                      [STATE_MIDDLE] = "middle",     [STATE_RIGHT] = "right",     [STATE_CTRL] = "ctrl",
+                                                      [STATE_SHIFT] = "shift",       [STATE_SCROLL_UP] = "scroll-up", [STATE_SCROLL_DOWN] = "scroll-down"};
+
+/* window, GC, and masks, which can be created lazily and released when idle */
+static int resources_ready = 0;
+static int resources_created = 0;
+static long long resources_creation_time = 0; /* of last creation, in microseconds */
+static int current_state = -1;
+static Pixmap dot_mask = None;
+static Pixmap current_mask = None;
+static Pixmap scroll_masks[4]; /* arrow masks for up, down, left, right */
+#define PEN_MASKS (PEN_LEVELS + 1)
+static Pixmap pen_masks[PEN_MASKS]; /* hover ring, then contact dots of increasing size */
+#define MASK_PICTURES (5 + PEN_MASKS)
+static Picture mask_pictures[MASK_PICTURES]; /* for dot_mask, scroll_masks, and pen_masks, only for RENDER_LAYER */
+
+#define RENDER_WINDOW 0  /* shaped window moved with the pointer */
+#define RENDER_OVERLAY 1 /* drawn into the Composite overlay window, without compositor */
+#define RENDER_LAYER 2   /* drawn into a screen-sized ARGB window, with compositor */
+static int render_mode = RENDER_WINDOW;
+static Window layer = None; /* overlay or ARGB window, which never moves */
+static Picture layer_picture = None;
+static XRenderPictFormat* sprite_format = NULL;
+static XserverRegion empty_region = None;
+static int drawn = 0; /* if highlight is drawn into layer at drawn_x, drawn_y */
+static int drawn_x;
+static int drawn_y;
+
+/* live heatmap of recent pointer positions in a screen-sized ARGB window, with lazily applied decay */
+#define HEATMAP_CELL 8                /* in pixels */
+#define HEATMAP_TILE 16               /* in cells, unit of rendering */
+#define HEATMAP_TILES_PER_FRAME 8     /* bounds the cost of a frame */
+#define HEATMAP_DECAY_INTERVAL 250000 /* between renderings of decaying tiles, in microseconds */
+#define HEATMAP_SATURATION 20.0f      /* density shown at 63% intensity */
+#define HEATMAP_ALPHA 0.6f
+#define HEATMAP_MIN 0.05f /* density below which a tile is cleared */
+static Window heatmap_win = None;
+static Picture heatmap_picture = None;
+static Pixmap heatmap_pixmap = None; /* at cell resolution */
+static Picture heatmap_grid_picture = None;
+static GC heatmap_gc;
+static XImage* heatmap_image = NULL; /* of one tile, on heatmap_tile_data */
+static unsigned int heatmap_tile_data[HEATMAP_TILE * HEATMAP_TILE];
+static float* heatmap = NULL; /* density per cell, as of heatmap_time */
+static long long* heatmap_time = NULL;
+static int heatmap_width; /* in cells */
+static int heatmap_height;
+static int heatmap_tiles_x;
+static int heatmap_tiles_y;
+static int heatmap_next_tile = 0; /* to render tiles round-robin */
+static struct {
+    int dirty;          /* density changed since rendered */
+    int active;         /* not cleared yet, so decay needs rendering */
+    long long rendered; /* last time */
+} * heatmap_tiles = NULL;
+
+/* scroll amounts in scroll increments ("clicks"), negative for up/left */
+#define SCROLL_DECAY 0.25 /* time constant of scroll intensity, in seconds */
+#define SCROLL_THRESHOLD 0.25
+static double scroll_amount[2] = {0, 0}; /* vertical and horizontal, since last frame */
+static double scroll_intensity = 0;
+static int scroll_state = STATE_SCROLL_UP;
+
+/* valuators per slave device, resolved once through XIQueryDevice */
+#define MAX_DEVICES 128
+static struct {
+    int scroll_valuators[2]; /* vertical and horizontal, or -1 */
+    double scroll_increments[2];
+    int pressure_valuator; /* or -1 */
+    double pressure_min;
+    double pressure_max;
+    int tilt_valuators[2]; /* x and y, or -1 */
+    double tilt_min[2];
+    double tilt_max[2];
+    int direct_touch; /* touchscreen, rather than touchpad */
+    int relative;     /* x and y are motion, rather than position */
+    int touch_valuators[2]; /* x and y */
+    double touch_min[2];
+    double touch_max[2];
+    float transform[9]; /* coordinate transformation matrix, from device to screen, both normalized */
+} devices[MAX_DEVICES];
+static int have_valuators = 0; /* for scrolling or pens */
+
+/* active touches of touchscreens, each shown by a window of a fixed pool */
+#define TOUCH_SLOTS 10
+static struct {
+    int active;
+    int id; /* touch ID of XInput */
+    double position[2]; /* normalized device coordinates */
+    int x;
+    int y;
+    int dirty; /* changed since last frame */
+    int mapped;
+    Window win;
+} touches[TOUCH_SLOTS];
+
+/* current touchpad gesture (XI 2.4), shown by a window per finger */
+#define GESTURE_FINGERS 5
+#define GESTURE_SPREAD 3 /* distance of fingers from anchor, in dot radii */
+static struct {
+    int active;
+    int fingers;
+    double x; /* anchor */
+    double y;
+    double scale; /* of pinch, since begin */
+    double dx; /* of swipe, since begin */
+    double dy;
+    int dirty; /* changed since last frame */
+    unsigned int mapped; /* bit per finger */
+    Window win[GESTURE_FINGERS];
+} gesture;
+
+/* pen state, from the device which moved last if it has a pressure valuator */
+static int pen_active = 0;
+static double pen_pressure = 0; /* relative, 0 to 1 */
+static int pen_offset_x = 0;    /* of highlight in direction of tilt */
+static int pen_offset_y = 0;
+
+static unsigned int buttons = 0;        /* bitmask of pressed buttons, bit n for button n */
+static unsigned int held_modifiers = 0; /* ShiftMask and ControlMask if tracked */
+
+#define MODIFIER_KEYS_SIZE 8
+static struct {
+    KeySym keysym;
+    unsigned int mask;
+    KeyCode keycode;
+} modifier_keys[MODIFIER_KEYS_SIZE] = {{XK_Control_L, ControlMask, 0}, {XK_Control_R, ControlMask, 0}, {XK_Shift_L, ShiftMask, 0}, {XK_Shift_R, ShiftMask, 0},
+                                       {XK_Alt_L, Mod1Mask, 0},        {XK_Alt_R, Mod1Mask, 0},        {XK_Super_L, Mod4Mask, 0}, {XK_Super_R, Mod4Mask, 0}};
+
+#define KEYS_POSITION_BOTTOM 0
+#define KEYS_POSITION_TOP 1
+#define KEYS_POSITION_POINTER 2
+/* keystroke overlay, labels are kept in a fixed ring and painted at most once per frame */
+#define KEYS_RING_SIZE 8
+#define KEYS_LABEL_SIZE 32
+#define KEYS_DISPLAY_TIME 2 /* in seconds */
+#define KEYS_PADDING 8
+static Window keys_win = 0;
+static XftFont* keys_font = NULL;
+static XftDraw* keys_draw = NULL;
+static XftColor keys_color;
+static char keys_ring[KEYS_RING_SIZE][KEYS_LABEL_SIZE];
+static int keys_ring_start = 0;
+static int keys_ring_count = 0;
+static int keys_dirty = 0;
+static int keys_plain = 0; /* if last label consists of plain characters only */
+static KeySym* keymap = NULL; /* cached keyboard mapping */
+static int keymap_min_keycode;
+static int keymap_max_keycode;
+static int keymap_width;
+
 static int cursor_visible = 1;
 static int highlight_visible = 0;
+static int highlight_mapped = 0;
+static int compositor = 0; /* if a compositing manager is running */
+
+static Atom opacity_atom;
+static double opacity = 1; /* current highlight window opacity when fading */
+
+static int pointer_x = 0; /* last known pointer position */
+static int pointer_y = 0;
+
+/* smooth-follow state: highlight center and velocity, in pixels and pixels per second */
+#define SMOOTH_FOLLOW_OMEGA 30.0 /* spring angular frequency, in 1/s */
+static double highlight_x = 0;
+static double highlight_y = 0;
+static double velocity_x = 0;
+static double velocity_y = 0;
+
+/* deadlines, in microseconds of get_time(), or 0 if not scheduled */
+static long long frame_deadline = 0;
+static long long idle_deadline = 0;
+static long long keys_deadline = 0;
+static long long typing_deadline = 0;
+static long long raise_deadline = 0;
+static long long stats_deadline = 0;
+static long long release_deadline = 0;
+
+/* low-bandwidth mode for remote displays: motion only marks the pointer position as dirty */
+#define LOW_BANDWIDTH_AUTO -1
+#define LOW_BANDWIDTH_RTT 2000 /* round-trip time above which a display is considered remote, in microseconds */
+#define LOW_BANDWIDTH_FPS 15
+#define LOW_BANDWIDTH_DEAD_ZONE 3 /* in pixels */
+#define LOW_BANDWIDTH_SYNC_INTERVAL 1000000 /* between pointer queries correcting the tracked position, in microseconds */
+static int low_bandwidth = 0;
+static int pointer_dirty = 0;
+static double tracked_x = 0; /* pointer position following raw motion */
+static double tracked_y = 0;
+static long long pointer_synced = 0; /* time of last pointer query */
+
+#define JITTER_BUCKETS 8 /* below 1, 2, 4, ..., 64 ms, and above */
+#define REALTIME_NICE -10 /* if real-time scheduling is not permitted */
+
+/* last loop iterations, dumped for post-mortem analysis of stutters */
+#define FLIGHT_RECORDER_SIZE 8192
+#define FLIGHT_RECORDER_DUMP_INTERVAL 10 /* minimum between automatic dumps, in seconds */
+static struct {
+    long long time;        /* of wakeup */
+    int late;              /* wakeup after deadline, in microseconds */
+    int duration;          /* of handling, in microseconds */
+    unsigned int events;   /* handled */
+    unsigned int requests; /* sent */
+} flight_recorder[FLIGHT_RECORDER_SIZE];
+static unsigned long flight_recorder_count = 0;
+static long long last_flight_recorder_dump = 0;
+
+/* pointer trace for offline analysis, one "time_ms x y buttons" line per known position */
+static FILE* trace = NULL;
+static char trace_buffer[1 << 16];
+static long long trace_start;
+
+/* keyframes of playback, see load_playback() */
+static struct keyframe {
+    long long time; /* in ms from start */
+    int x;
+    int y;
+    unsigned int buttons;
+    int easing; /* of movement towards this keyframe */
+} * keyframes = NULL;
+static int keyframe_count = 0;
+static int keyframe_capacity = 0;
+static int playback_index = 0; /* last keyframe passed */
+static long long playback_frame = 0;
+static long long playback_start;
+static long long playback_deadline = 0;
+
+/* difference of local and server clock, in ms, taken as the smallest seen */
+static unsigned int time_offset;
+static int have_time_offset = 0;
+
+static struct {
+    long long time;
+    unsigned long requests; /* XNextRequest at start of interval */
+    long long bytes_sent;
+    long long bytes_received;
+    unsigned long wakeups;
+    unsigned long events;
+    unsigned long frames;
+    unsigned long jitter[JITTER_BUCKETS]; /* delays between event and its handling */
+} stats;
+
+/* detection of other clients raising their windows over and over as well */
+#define RAISE_HISTORY_SIZE 8
+#define RAISE_STORM_WINDOW 1000000 /* in microseconds */
+#define RAISE_BACKOFF_MIN 50000
+#define RAISE_BACKOFF_MAX 5000000
+static long long raise_history[RAISE_HISTORY_SIZE]; /* times of last raises */
+static int raise_history_next = 0;
+static long long raise_backoff = 0;
+
+static int hidden_by_typing = 0;
+
+/* suspending while a fullscreen window or a window of a given class is active */
+#define SUSPEND_CLASSES_SIZE 8
+#define WM_CLASS_CACHE_SIZE 16
+static Atom active_window_atom;
+static Atom wm_state_atom;
+static Atom fullscreen_atom;
+static Window active_window = None;
+static int active_fullscreen = 0;
+static int active_class_matches = 0;
+static int suspended = 0;
+static struct {
+    Window window;
+    int matches;
+} wm_class_cache[WM_CLASS_CACHE_SIZE];
+static int wm_class_cache_next = 0;
+static long long last_frame = 0;
 
+#define PRESETS_SIZE 8 /* see build_presets() */
 static struct {
     char* pressed_color_string;
     char* released_color_string;
+    char* state_color_strings[STATE_COUNT]; /* NULL to use pressed/released color */
     int auto_hide_cursor;
     int auto_hide_highlight;
     int cursor_visible;
+    int fade;
+    int frame_rate;
     int hide_timeout;
+    int auto_render;
+    int check_allocations; /* rounds of synthetic input, or 0 */
+    int cpu;               /* to pin to, or -1 */
+    char* flight_recorder; /* file to dump to, or NULL */
+    char* analyze;         /* trace to analyze, or NULL */
+    double blur;           /* of heatmaps, in pixels */
+    char* record_trace;    /* file to record to, or NULL */
+    char* play;            /* script or trace to play, or NULL */
+    char* dump_sprites;    /* directory, or NULL */
+    char* compare_sprites; /* directory, or NULL */
+    char* style;           /* file, or NULL */
+    char* image;           /* file, or NULL */
+    int diagnose;
+    int heatmap;
+    double heatmap_decay; /* time constant, in seconds */
+    int hide_while_typing;
+    int lazy;
+    int low_bandwidth;
+    int overlay;
+    int pixmap_cap; /* in KiB, or 0 */
+    int realtime;
+    int release_after;
+    int stats_interval;
     int highlight_visible;
+    char* keys_font;
+    int keys_position;
     int outline;
     int radius;
+    int show_keys;
+    int smooth_follow;
+    int touch;
+    int gestures;
+    int stall_threshold; /* in ms */
+    int suspend_fullscreen;
+    char* suspend_classes[SUSPEND_CLASSES_SIZE];
+    int suspend_classes_count;
+    char* preset_files[PRESETS_SIZE];
+    int preset_files_count;
 } options;
 
-static void redraw();
+static void update_state();
+static void add_heat(int x, int y);
 static int get_pointer_position(int* x, int* y);
+static int create_resources();
+static Pixmap create_sprite_mask(int i);
+static void free_inactive_presets(int all);
 
 static void show_cursor() {
     XFixesShowCursor(dpy, root);
@@ -112,89 +543,494 @@ static void hide_cursor() {
     cursor_visible = 0;
 }
 
-static void show_highlight() {
-    int x, y;
-    int total_radius = options.radius + options.outline;
-    get_pointer_position(&x, &y);
+static long long get_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* earliest of two deadlines, where 0 means not scheduled */
+static long long earliest(long long a, long long b) {
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+    return a < b ? a : b;
+}
+
+static void request_frame() {
+    if (!frame_deadline) {
+        long long now = get_time();
+        frame_deadline = last_frame + 1000000 / options.frame_rate;
+        if (frame_deadline < now) {
+            frame_deadline = now;
+        }
+    }
+}
+
+/* only repaints the old and new highlight rectangles of the layer */
+static void paint_highlight(int x, int y) {
+    int total_radius = sprite_radius;
+    int size = 2 * total_radius + 2;
+    if (pen_active) {
+        x += pen_offset_x;
+        y += pen_offset_y;
+    }
+    if (render_mode == RENDER_OVERLAY) {
+        /* the shape takes away the old rectangle */
+        XShapeCombineMask(dpy, layer, ShapeBounding, x - total_radius - 1, y - total_radius - 1, states[current_state].mask ? states[current_state].mask : dot_mask, ShapeSet);
+        XCopyArea(dpy, states[current_state].pixmap, layer, gc, 0, 0, size, size, x - total_radius - 1, y - total_radius - 1);
+    } else {
+        if (drawn) {
+            XRenderColor transparent = {0, 0, 0, 0};
+            XRenderFillRectangle(dpy, PictOpSrc, layer_picture, &transparent, drawn_x - total_radius - 1, drawn_y - total_radius - 1, size, size);
+        }
+        XRenderComposite(dpy, PictOpOver, states[current_state].picture, states[current_state].mask_picture, layer_picture, 0, 0, 0, 0, x - total_radius - 1,
+                         y - total_radius - 1, size, size);
+    }
+    drawn = 1;
+    drawn_x = x;
+    drawn_y = y;
+}
+
+static void erase_highlight() {
+    int total_radius = sprite_radius;
+    if (!drawn) {
+        return;
+    }
+    if (render_mode == RENDER_OVERLAY) {
+        XFixesSetWindowShapeRegion(dpy, layer, ShapeBounding, 0, 0, empty_region);
+    } else {
+        XRenderColor transparent = {0, 0, 0, 0};
+        XRenderFillRectangle(dpy, PictOpSrc, layer_picture, &transparent, drawn_x - total_radius - 1, drawn_y - total_radius - 1, 2 * total_radius + 2, 2 * total_radius + 2);
+    }
+    drawn = 0;
+}
+
+static void move_highlight(int x, int y) {
+    int total_radius = sprite_radius;
+    if (render_mode != RENDER_WINDOW) {
+        paint_highlight(x, y);
+        return;
+    }
+    if (pen_active) {
+        x += pen_offset_x;
+        y += pen_offset_y;
+    }
     XMoveWindow(dpy, win, x - total_radius - 1, y - total_radius - 1);
-    XMapWindow(dpy, win);
-    redraw();
+}
+
+static int use_fade() { return options.fade > 0 && compositor; }
+
+static void set_opacity(double value) {
+    unsigned long v = value * 0xffffffffu; /* format 32 property data is long */
+    opacity = value;
+    XChangeProperty(dpy, render_mode == RENDER_LAYER ? layer : win, opacity_atom, XA_CARDINAL, 32, PropModeReplace, (unsigned char*)&v, 1);
+}
+
+static void show_highlight() {
+    get_pointer_position(&pointer_x, &pointer_y);
+    highlight_x = pointer_x;
+    highlight_y = pointer_y;
+    velocity_x = 0;
+    velocity_y = 0;
     highlight_visible = 1;
+    hidden_by_typing = 0;
+    if (!resources_ready && create_resources()) {
+        return;
+    }
+    if (render_mode != RENDER_WINDOW) {
+        update_state();
+        paint_highlight(pointer_x, pointer_y);
+        if (use_fade()) {
+            request_frame();
+        }
+        return;
+    }
+    move_highlight(pointer_x, pointer_y);
+    if (use_fade() && highlight_mapped) {
+        /* window is kept mapped while faded out, so no redraw needed */
+        request_frame();
+        return;
+    }
+    update_state();
+    if (use_fade()) {
+        /* unmapped by suspend() mid-fade, so fade in from scratch */
+        set_opacity(0);
+        request_frame();
+    }
+    XMapWindow(dpy, win);
+    highlight_mapped = 1;
 }
 
 static void hide_highlight() {
-    XUnmapWindow(dpy, win);
     highlight_visible = 0;
+    if (!resources_ready) {
+        return;
+    }
+    if (use_fade()) {
+        request_frame();
+        return;
+    }
+    if (render_mode != RENDER_WINDOW) {
+        erase_highlight();
+        return;
+    }
+    XUnmapWindow(dpy, win);
+    highlight_mapped = 0;
 }
 
-static int init_events() {
-    XIEventMask events;
-    unsigned char mask[(XI_LASTEVENT + 7) / 8];
+static void init_devices() {
+    int n;
+    XIDeviceInfo* info = XIQueryDevice(dpy, XIAllDevices, &n);
+    Atom pressure_label = XInternAtom(dpy, "Abs Pressure", True);
+    Atom tilt_labels[2] = {XInternAtom(dpy, "Abs Tilt X", True), XInternAtom(dpy, "Abs Tilt Y", True)};
+    Atom transform_property = XInternAtom(dpy, "Coordinate Transformation Matrix", True);
+    Atom float_atom = XInternAtom(dpy, "FLOAT", True);
+    have_valuators = 0;
+    for (int i = 0; i < MAX_DEVICES; ++i) {
+        devices[i].scroll_valuators[0] = -1;
+        devices[i].scroll_valuators[1] = -1;
+        devices[i].pressure_valuator = -1;
+        devices[i].tilt_valuators[0] = -1;
+        devices[i].tilt_valuators[1] = -1;
+        devices[i].direct_touch = 0;
+        devices[i].relative = 1;
+        devices[i].touch_valuators[0] = -1;
+        devices[i].touch_valuators[1] = -1;
+        for (int k = 0; k < 9; ++k) {
+            devices[i].transform[k] = k % 4 == 0;
+        }
+    }
+    for (int i = 0; i < n; ++i) {
+        if (info[i].deviceid < 0 || info[i].deviceid >= MAX_DEVICES) {
+            continue;
+        }
+        for (int j = 0; j < info[i].num_classes; ++j) {
+            if (info[i].classes[j]->type == XIScrollClass) {
+                const XIScrollClassInfo* scroll = (const XIScrollClassInfo*)info[i].classes[j];
+                int k = scroll->scroll_type == XIScrollTypeVertical ? 0 : 1;
+                devices[info[i].deviceid].scroll_valuators[k] = scroll->number;
+                devices[info[i].deviceid].scroll_increments[k] = scroll->increment ? scroll->increment : 1;
+                have_valuators = 1;
+            } else if (info[i].classes[j]->type == XITouchClass) {
+                devices[info[i].deviceid].direct_touch = ((const XITouchClassInfo*)info[i].classes[j])->mode == XIDirectTouch;
+            } else if (info[i].classes[j]->type == XIValuatorClass) {
+                const XIValuatorClassInfo* valuator = (const XIValuatorClassInfo*)info[i].classes[j];
+                if (valuator->number == 0) {
+                    devices[info[i].deviceid].relative = valuator->mode == XIModeRelative;
+                }
+                if (valuator->max <= valuator->min) {
+                    continue;
+                }
+                if (valuator->number < 2) {
+                    /* first two are x and y */
+                    devices[info[i].deviceid].touch_valuators[valuator->number] = valuator->number;
+                    devices[info[i].deviceid].touch_min[valuator->number] = valuator->min;
+                    devices[info[i].deviceid].touch_max[valuator->number] = valuator->max;
+                }
+                if (valuator->label == pressure_label && pressure_label != None) {
+                    devices[info[i].deviceid].pressure_valuator = valuator->number;
+                    devices[info[i].deviceid].pressure_min = valuator->min;
+                    devices[info[i].deviceid].pressure_max = valuator->max;
+                    have_valuators = 1;
+                }
+                for (int k = 0; k < 2; ++k) {
+                    if (valuator->label == tilt_labels[k] && tilt_labels[k] != None) {
+                        devices[info[i].deviceid].tilt_valuators[k] = valuator->number;
+                        devices[info[i].deviceid].tilt_min[k] = valuator->min;
+                        devices[info[i].deviceid].tilt_max[k] = valuator->max;
+                    }
+                }
+            }
+        }
+        if (devices[info[i].deviceid].direct_touch && transform_property != None && float_atom != None) {
+            /* maps a touchscreen to its monitor */
+            Atom type;
+            int format;
+            unsigned long items, after;
+            unsigned char* data = NULL;
+            if (XIGetProperty(dpy, info[i].deviceid, transform_property, 0, 9, False, float_atom, &type, &format, &items, &after, &data) == Success) {
+                if (type == float_atom && format == 32 && items == 9) {
+                    /* XInput property data is packed, unlike that of window properties */
+                    memcpy(devices[info[i].deviceid].transform, data, sizeof(devices[info[i].deviceid].transform));
+                }
+                XFree(data);
+            }
+        }
+    }
+    XIFreeDeviceInfo(info);
+}
+
+static void select_events() {
+    XIEventMask events[2];
+    unsigned char mask[XIMaskLen(XI_LASTEVENT)];
+    unsigned char hierarchy_mask[XIMaskLen(XI_LASTEVENT)];
     memset(mask, 0, sizeof(mask));
+    memset(hierarchy_mask, 0, sizeof(hierarchy_mask));
+
+    /* while suspended, no input events are selected at all */
+    if (!suspended) {
+        XISetMask(mask, XI_RawButtonPress);
+        XISetMask(mask, XI_RawButtonRelease);
+        XISetMask(mask, XI_RawMotion);
+        if (options.state_color_strings[STATE_CTRL] || options.state_color_strings[STATE_SHIFT] || options.show_keys || options.hide_while_typing) {
+            XISetMask(mask, XI_RawKeyPress);
+            XISetMask(mask, XI_RawKeyRelease);
+        }
+        if (options.touch) {
+            XISetMask(mask, XI_RawTouchBegin);
+            XISetMask(mask, XI_RawTouchUpdate);
+            XISetMask(mask, XI_RawTouchEnd);
+        }
+        if (options.gestures) {
+            /* there are no raw gesture events, so these only arrive if
+               the window under the pointer does not select them */
+            XISetMask(mask, XI_GesturePinchBegin);
+            XISetMask(mask, XI_GesturePinchUpdate);
+            XISetMask(mask, XI_GesturePinchEnd);
+            XISetMask(mask, XI_GestureSwipeBegin);
+            XISetMask(mask, XI_GestureSwipeUpdate);
+            XISetMask(mask, XI_GestureSwipeEnd);
+        }
+    }
+
+    events[0].deviceid = XIAllMasterDevices;
+    events[0].mask = mask;
+    events[0].mask_len = sizeof(mask);
+
+    /* to re-resolve valuators when devices are added */
+    XISetMask(hierarchy_mask, XI_HierarchyChanged);
+    events[1].deviceid = XIAllDevices;
+    events[1].mask = hierarchy_mask;
+    events[1].mask_len = sizeof(hierarchy_mask);
 
-    XISetMask(mask, XI_RawButtonPress);
-    XISetMask(mask, XI_RawButtonRelease);
-    XISetMask(mask, XI_RawMotion);
+    XISelectEvents(dpy, root, events, 2);
+}
 
-    events.deviceid = XIAllMasterDevices;
-    events.mask = mask;
-    events.mask_len = sizeof(mask);
+static int init_events() {
+    for (int i = 0; i < MODIFIER_KEYS_SIZE; ++i) {
+        modifier_keys[i].keycode = XKeysymToKeycode(dpy, modifier_keys[i].keysym);
+    }
+    select_events();
+    init_devices();
 
-    XISelectEvents(dpy, root, &events, 1);
+    if (options.suspend_fullscreen || options.suspend_classes_count) {
+        active_window_atom = XInternAtom(dpy, "_NET_ACTIVE_WINDOW", False);
+        wm_state_atom = XInternAtom(dpy, "_NET_WM_STATE", False);
+        fullscreen_atom = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
+        XSelectInput(dpy, root, PropertyChangeMask);
+    }
 
     return 0;
 }
 
+static int is_fullscreen(Window w) {
+    Atom type;
+    int format;
+    unsigned long n, remaining;
+    unsigned char* data = NULL;
+    int res = 0;
+    if (XGetWindowProperty(dpy, w, wm_state_atom, 0, 64, False, XA_ATOM, &type, &format, &n, &remaining, &data) == Success && data) {
+        for (unsigned long i = 0; i < n; ++i) {
+            if (((Atom*)data)[i] == fullscreen_atom) {
+                res = 1;
+                break;
+            }
+        }
+        XFree(data);
+    }
+    return res;
+}
+
+/* WM_CLASS lookups are cached per window ID, until the window is destroyed and the ID may be reused */
+static int wm_class_matches(Window w) {
+    XClassHint hint;
+    int matches = 0;
+    for (int i = 0; i < WM_CLASS_CACHE_SIZE; ++i) {
+        if (wm_class_cache[i].window == w) {
+            return wm_class_cache[i].matches;
+        }
+    }
+    if (XGetClassHint(dpy, w, &hint)) {
+        for (int i = 0; i < options.suspend_classes_count; ++i) {
+            if ((hint.res_name && strcmp(hint.res_name, options.suspend_classes[i]) == 0) || (hint.res_class && strcmp(hint.res_class, options.suspend_classes[i]) == 0)) {
+                matches = 1;
+                break;
+            }
+        }
+        XFree(hint.res_name);
+        XFree(hint.res_class);
+    }
+    if (wm_class_cache[wm_class_cache_next].window != None && wm_class_cache[wm_class_cache_next].window != active_window) {
+        XSelectInput(dpy, wm_class_cache[wm_class_cache_next].window, NoEventMask);
+    }
+    wm_class_cache[wm_class_cache_next].window = w;
+    wm_class_cache[wm_class_cache_next].matches = matches;
+    wm_class_cache_next = (wm_class_cache_next + 1) % WM_CLASS_CACHE_SIZE;
+    return matches;
+}
+
+static void suspend() {
+    suspended = 1;
+    highlight_visible = 0;
+    if (render_mode != RENDER_WINDOW) {
+        erase_highlight();
+    } else if (highlight_mapped) {
+        XUnmapWindow(dpy, win);
+        highlight_mapped = 0;
+    }
+    if (!cursor_visible) {
+        show_cursor();
+    }
+    select_events();
+}
+
+static void resume() {
+    suspended = 0;
+    select_events();
+    if (!options.cursor_visible) {
+        hide_cursor();
+    }
+    if (options.highlight_visible) {
+        show_highlight();
+    }
+}
+
+static void update_suspend() {
+    int suspend_now = active_fullscreen || active_class_matches;
+    if (suspend_now && !suspended) {
+        suspend();
+    } else if (!suspend_now && suspended) {
+        resume();
+    }
+}
+
+static void update_active_window() {
+    Atom type;
+    int format;
+    unsigned long n, remaining;
+    unsigned char* data = NULL;
+    Window w = None;
+    if (XGetWindowProperty(dpy, root, active_window_atom, 0, 1, False, XA_WINDOW, &type, &format, &n, &remaining, &data) == Success && data) {
+        if (n > 0) {
+            w = *(Window*)data;
+        }
+        XFree(data);
+    }
+    if (w == active_window) {
+        return;
+    }
+    /* cached windows keep StructureNotifyMask for their DestroyNotify */
+    long cache_mask = options.suspend_classes_count ? StructureNotifyMask : NoEventMask;
+    if (active_window != None) {
+        XSelectInput(dpy, active_window, cache_mask);
+    }
+    active_window = w;
+    active_fullscreen = 0;
+    active_class_matches = 0;
+    if (w != None) {
+        /* to follow fullscreen state changes */
+        XSelectInput(dpy, w, PropertyChangeMask | cache_mask);
+        active_fullscreen = options.suspend_fullscreen && is_fullscreen(w);
+        active_class_matches = options.suspend_classes_count && wm_class_matches(w);
+    }
+    update_suspend();
+}
+
+static void record_trace(int x, int y) {
+    if (trace) {
+        fprintf(trace, "%lld %d %d %u\n", (get_time() - trace_start) / 1000, x, y, buttons);
+    }
+}
+
 static int get_pointer_position(int* x, int* y) {
     Window w;
     int i;
     unsigned int ui;
-    return XQueryPointer(dpy, root, &w, &w, x, y, &i, &i, &ui);
+    int res = XQueryPointer(dpy, root, &w, &w, x, y, &i, &i, &ui);
+    record_trace(*x, *y);
+    add_heat(*x, *y);
+    return res;
 }
 
-static void set_window_mask() {
+/* dot of given radius and outline, centered in the highlight */
+static void draw_dot(Drawable d, GC g, int radius, int outline) {
+    int offset = sprite_radius - radius;
+    if (outline) {
+        XSetLineAttributes(dpy, g, outline, LineSolid, CapButt, JoinBevel);
+        XDrawArc(dpy, d, g, offset, offset, 2 * radius + 1, 2 * radius + 1, 0, 360 * 64);
+    } else {
+        XFillArc(dpy, d, g, offset, offset, 2 * radius + 1, 2 * radius + 1, 0, 360 * 64);
+    }
+}
+
+/* radius and outline of pen states */
+static void get_pen_dot(int state, int* radius, int* outline) {
+    if (state == STATE_PEN_HOVER) {
+        *radius = options.radius > PEN_HOVER_OUTLINE ? options.radius - PEN_HOVER_OUTLINE / 2 : options.radius;
+        *outline = PEN_HOVER_OUTLINE;
+    } else {
+        int level = state - STATE_PEN_CONTACT;
+        *radius = options.radius * (level + 1) / PEN_LEVELS;
+        *outline = 0;
+    }
+}
+
+static Pixmap create_mask_with_dot(int radius, int outline) {
     XGCValues gc_values;
-    int total_radius = options.radius + options.outline;
-    Pixmap mask = XCreatePixmap(dpy, win, 2 * total_radius + 2, 2 * total_radius + 2, 1);
+    int total_radius = sprite_radius;
+    Pixmap mask = XCreatePixmap(dpy, root, 2 * total_radius + 2, 2 * total_radius + 2, 1);
     GC mask_gc = XCreateGC(dpy, mask, 0, &gc_values);
     XSetForeground(dpy, mask_gc, 0);
-    XFillRectangle(dpy, mask, mask_gc, options.outline, options.outline, 2 * total_radius + 2, 2 * total_radius + 2);
+    XFillRectangle(dpy, mask, mask_gc, 0, 0, 2 * total_radius + 2, 2 * total_radius + 2);
 
     XSetForeground(dpy, mask_gc, 1);
-    if (options.outline) {
-        XSetLineAttributes(dpy, mask_gc, options.outline, LineSolid, CapButt, JoinBevel);
-        XDrawArc(dpy, mask, mask_gc, options.outline, options.outline, 2 * options.radius + 1, 2 * options.radius + 1, 0, 360 * 64);
-    } else {
-        XFillArc(dpy, mask, mask_gc, options.outline, options.outline, 2 * options.radius + 1, 2 * options.radius + 1, 0, 360 * 64);
-    }
-
-    XShapeCombineMask(dpy, win, ShapeBounding, 0, 0, mask, ShapeSet);
+    draw_dot(mask, mask_gc, radius, outline);
 
     XFreeGC(dpy, mask_gc);
-    XFreePixmap(dpy, mask);
+    return mask;
 }
 
-static int init_window() {
-    int total_radius = options.radius + options.outline;
+static Pixmap create_mask() { return style_sprites ? create_sprite_mask(STATE_RELEASED) : create_mask_with_dot(options.radius, options.outline); }
+
+static void set_window_mask() {
+    dot_mask = create_mask();
+    XShapeCombineMask(dpy, win, ShapeBounding, 0, 0, dot_mask, ShapeSet);
+    current_mask = dot_mask;
+}
+
+static void detect_compositor() {
+    char cm_selection[32];
+    snprintf(cm_selection, sizeof(cm_selection), "_NET_WM_CM_S%d", screen);
+    compositor = XGetSelectionOwner(dpy, XInternAtom(dpy, cm_selection, False)) != None;
+    opacity_atom = XInternAtom(dpy, "_NET_WM_WINDOW_OPACITY", False);
+}
+
+/* shaped later, on top, and letting clicks fall through */
+static Window create_highlight_window(long event_mask) {
+    int total_radius = sprite_radius;
     XSetWindowAttributes win_attributes;
-    win_attributes.event_mask = ExposureMask | VisibilityChangeMask;
+    win_attributes.event_mask = event_mask;
     win_attributes.override_redirect = True;
 
-    win = XCreateWindow(dpy, root, options.outline, options.outline, 2 * total_radius + 2, 2 * total_radius + 2, 0, DefaultDepth(dpy, screen), InputOutput, DefaultVisual(dpy, screen),
-                        CWEventMask | CWOverrideRedirect, &win_attributes);
-    if (!win) {
+    Window w = XCreateWindow(dpy, root, options.outline, options.outline, 2 * total_radius + 2, 2 * total_radius + 2, 0, DefaultDepth(dpy, screen), InputOutput,
+                             DefaultVisual(dpy, screen), CWEventMask | CWOverrideRedirect, &win_attributes);
+    if (!w) {
         fprintf(stderr, "Can't create highlight window\n");
-        return 1;
+        return None;
     }
 
     XClassHint class_hint;
-    XStoreName(dpy, win, "highlight-pointer");
+    XStoreName(dpy, w, "highlight-pointer");
     class_hint.res_name = "highlight-pointer";
     class_hint.res_class = "HighlightPointer";
-    XSetClassHint(dpy, win, &class_hint);
+    XSetClassHint(dpy, w, &class_hint);
 
     Atom window_type_atom = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DND", False);
-    XChangeProperty(dpy, win, XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False), XA_ATOM, 32, PropModeReplace, (unsigned char*)&window_type_atom, 1);
+    XChangeProperty(dpy, w, XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False), XA_ATOM, 32, PropModeReplace, (unsigned char*)&window_type_atom, 1);
 
     /* hide window decorations */
     /* after https://github.com/akkana/moonroot */
@@ -208,14 +1044,14 @@ static int init_window() {
     } mwmhints;
     mwmhints.flags = 1L << 1 /* MWM_HINTS_DECORATIONS */;
     mwmhints.decorations = 0;
-    XChangeProperty(dpy, win, motif_wm_hints, motif_wm_hints, 32, PropModeReplace, (unsigned char*)&mwmhints, 5 /* PROP_MWM_HINTS_ELEMENTS */);
+    XChangeProperty(dpy, w, motif_wm_hints, motif_wm_hints, 32, PropModeReplace, (unsigned char*)&mwmhints, 5 /* PROP_MWM_HINTS_ELEMENTS */);
 
     /* always stay on top */
     /* after gdk_wmspec_change_state */
     XClientMessageEvent xclient;
     memset(&xclient, 0, sizeof(xclient));
     xclient.type = ClientMessage;
-    xclient.window = win;
+    xclient.window = w;
     xclient.message_type = XInternAtom(dpy, "_NET_WM_STATE", False);
     xclient.format = 32;
     xclient.data.l[0] = 1 /* _NET_WM_STATE_ADD */;
@@ -229,9 +1065,18 @@ static int init_window() {
     /* after https://stackoverflow.com/a/9279747 */
     XRectangle rect;
     XserverRegion region = XFixesCreateRegion(dpy, &rect, 1);
-    XFixesSetWindowShapeRegion(dpy, win, ShapeInput, 0, 0, region);
+    XFixesSetWindowShapeRegion(dpy, w, ShapeInput, 0, 0, region);
     XFixesDestroyRegion(dpy, region);
 
+    return w;
+}
+
+static int init_window() {
+    win = create_highlight_window(VisibilityChangeMask);
+    if (!win) {
+        return 1;
+    }
+
     XGCValues gc_values;
     gc_values.foreground = WhitePixel(dpy, screen);
     gc_values.background = BlackPixel(dpy, screen);
@@ -242,386 +1087,3747 @@ static int init_window() {
     return 0;
 }
 
-static void redraw() {
-    XSetForeground(dpy, gc, button_pressed ? pressed_color.pixel : released_color.pixel);
-    if (options.outline) {
-        XSetLineAttributes(dpy, gc, options.outline, LineSolid, CapButt, JoinBevel);
-        XDrawArc(dpy, win, gc, options.outline, options.outline, 2 * options.radius + 1, 2 * options.radius + 1, 0, 360 * 64);
-    } else {
-        XFillArc(dpy, win, gc, options.outline, options.outline, 2 * options.radius + 1, 2 * options.radius + 1, 0, 360 * 64);
-    }
+/* arrow pointing up, down, left, or right for scroll states */
+static void get_arrow(int direction, XPoint* points) {
+    int total_radius = sprite_radius;
+    int c = total_radius + 1;
+    int a = options.radius * 3 / 5 > 2 ? options.radius * 3 / 5 : 2;
+    static const int tip[4][2] = {{0, -1}, {0, 1}, {-1, 0}, {1, 0}};
+    int dx = tip[direction][0], dy = tip[direction][1];
+    points[0].x = c + dx * a;
+    points[0].y = c + dy * a;
+    points[1].x = c - dx * a / 2 + dy * a;
+    points[1].y = c - dy * a / 2 + dx * a;
+    points[2].x = c - dx * a / 2 - dy * a;
+    points[2].y = c - dy * a / 2 - dx * a;
 }
 
-static void quit() { write(selfpipe[1], "", 1); }
-
-static void handle_key(KeySym keysym, unsigned int modifiers) {
-    modifiers = modifiers & ~(numlockmask | LockMask);
-    int k;
-    for (k = 0; k < KEY_ARRAY_SIZE; ++k) {
-        if (keys[k].keysym == keysym && keys[k].modifiers == modifiers) {
-            break;
+/* color option of state i, and its scroll or pressure level if any */
+static int get_color_option(int i, int* level, int* levels) {
+    int option = i;
+    if (level) {
+        *level = -1;
+        *levels = 0;
+    }
+    if (i >= STATE_PEN_HOVER) {
+        option = i == STATE_PEN_HOVER ? STATE_RELEASED : STATE_LEFT;
+        if (level) {
+            *level = i - STATE_PEN_CONTACT;
+            *levels = PEN_LEVELS;
+        }
+    } else if (i >= STATE_SCROLL_UP) {
+        /* up and left share a color, as do down and right */
+        option = ((i - STATE_SCROLL_UP) / SCROLL_LEVELS) % 2 ? STATE_SCROLL_DOWN : STATE_SCROLL_UP;
+        if (level) {
+            *level = (i - STATE_SCROLL_UP) % SCROLL_LEVELS;
+            *levels = SCROLL_LEVELS;
         }
     }
-    switch (k) {
-        case KEY_QUIT:
-            quit();
-            break;
-
-        case KEY_TOGGLE_CURSOR:
-            options.cursor_visible = 1 - options.cursor_visible;
-            if (options.cursor_visible && !cursor_visible) {
-                show_cursor();
-            } else if (!options.cursor_visible && cursor_visible) {
-                hide_cursor();
-            }
-            break;
+    return option;
+}
 
-        case KEY_TOGGLE_HIGHLIGHT:
-            if (options.highlight_visible) {
-                hide_highlight();
-            } else {
-                show_highlight();
-            }
-            options.highlight_visible = 1 - options.highlight_visible;
-            break;
+/* style layers, see load_style() */
+static int to_channel(unsigned int value, unsigned long mask) {
+    int shift = 0;
+    if (value > 255) {
+        value = 255;
+    }
+    if (!mask) {
+        return 0;
+    }
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++shift;
+    }
+    return (value * mask / 255) << shift;
+}
 
-        case KEY_TOGGLE_AUTOHIDE_CURSOR:
-            options.auto_hide_cursor = 1 - options.auto_hide_cursor;
-            break;
+/* RGB or RGB_ALPHA PAM image with MAXVAL 255, as written by --dump-sprites */
+static unsigned char* load_pam(const char* filename, int* width, int* height) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        perror(filename);
+        return NULL;
+    }
+    char line[256];
+    int depth = 0, maxval = 0;
+    *width = 0;
+    *height = 0;
+    if (!fgets(line, sizeof(line), file) || strcmp(line, "P7\n")) {
+        fprintf(stderr, "%s: not a PAM image\n", filename);
+        fclose(file);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), file) && strcmp(line, "ENDHDR\n")) {
+        sscanf(line, "WIDTH %d", width);
+        sscanf(line, "HEIGHT %d", height);
+        sscanf(line, "DEPTH %d", &depth);
+        sscanf(line, "MAXVAL %d", &maxval);
+    }
+    if (*width <= 0 || *height <= 0 || (depth != 3 && depth != 4) || maxval != 255) {
+        fprintf(stderr, "%s: unsupported PAM image\n", filename);
+        fclose(file);
+        return NULL;
+    }
+    unsigned char* image = malloc((size_t)*width * *height * 4);
+    if (!image) {
+        fprintf(stderr, "Could not allocate image\n");
+        fclose(file);
+        return NULL;
+    }
+    for (int i = 0; i < *width * *height; ++i) {
+        image[4 * i + 3] = 255;
+        if (fread(&image[4 * i], depth, 1, file) != 1) {
+            fprintf(stderr, "%s: truncated PAM image\n", filename);
+            free(image);
+            fclose(file);
+            return NULL;
+        }
+    }
+    fclose(file);
+    return image;
+}
 
-        case KEY_TOGGLE_AUTOHIDE_HIGHLIGHT:
-            options.auto_hide_highlight = 1 - options.auto_hide_highlight;
-            break;
+static unsigned char* load_png(const char* filename, int* width, int* height) {
+    png_image png;
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&png, filename)) {
+        fprintf(stderr, "%s: %s\n", filename, png.message);
+        return NULL;
     }
+    png.format = PNG_FORMAT_RGBA;
+    unsigned char* image = malloc(PNG_IMAGE_SIZE(png));
+    if (!image) {
+        fprintf(stderr, "Could not allocate image\n");
+        png_image_free(&png);
+        return NULL;
+    }
+    if (!png_image_finish_read(&png, NULL, image, 0, NULL)) {
+        fprintf(stderr, "%s: %s\n", filename, png.message);
+        free(image);
+        return NULL;
+    }
+    *width = png.width;
+    *height = png.height;
+    return image;
 }
 
-static void main_loop() {
-    XEvent ev;
-    fd_set fds;
-    int fd = ConnectionNumber(dpy);
-    struct timeval timeout;
-    int x, y, n;
-    int total_radius = options.radius + options.outline;
-    XGenericEventCookie* cookie;
-#if TARGET_FPS > 0
-    Time lasttime = 0;
-#endif
+/* converts to premultiplied floats once and pre-scales by halving, so
+   that every sprite size samples a level close to its own */
+static int load_image(struct style_layer* l, const char* filename) {
+    unsigned char signature[8] = {0};
+    int width, height;
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        perror(filename);
+        return 1;
+    }
+    /* files shorter than the signature are not PNG */
+    int png = fread(signature, 1, sizeof(signature), file) == sizeof(signature) && !png_sig_cmp(signature, 0, sizeof(signature));
+    fclose(file);
+    unsigned char* image = png ? load_png(filename, &width, &height) : load_pam(filename, &width, &height);
+    if (!image) {
+        return 1;
+    }
+    l->mips[0] = malloc((size_t)width * height * sizeof(v4sf));
+    if (!l->mips[0]) {
+        fprintf(stderr, "Could not allocate image\n");
+        free(image);
+        return 1;
+    }
+    for (int i = 0; i < width * height; ++i) {
+        const unsigned char* p = &image[4 * i];
+        v4sf v = {p[0], p[1], p[2], p[3]};
+        v4sf alpha = {p[3], p[3], p[3], 255};
+        l->mips[0][i] = v * alpha * (1.0f / (255 * 255));
+    }
+    free(image);
+    l->mip_widths[0] = width;
+    l->mip_heights[0] = height;
+    l->mip_count = 1;
+    while (l->mip_count < IMAGE_MIPS && (width > 1 || height > 1)) {
+        const v4sf* src = l->mips[l->mip_count - 1];
+        int src_width = width;
+        int src_height = height;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        v4sf* dst = malloc((size_t)width * height * sizeof(v4sf));
+        if (!dst) {
+            fprintf(stderr, "Could not allocate image\n");
+            while (l->mip_count > 0) {
+                free(l->mips[--l->mip_count]);
+            }
+            return 1;
+        }
+        for (int y = 0; y < height; ++y) {
+            /* odd sizes repeat the last row or column */
+            int y0 = 2 * y;
+            int y1 = y0 + 1 < src_height ? y0 + 1 : y0;
+            for (int x = 0; x < width; ++x) {
+                int x0 = 2 * x;
+                int x1 = x0 + 1 < src_width ? x0 + 1 : x0;
+                dst[y * width + x] = (src[y0 * src_width + x0] + src[y0 * src_width + x1] + src[y1 * src_width + x0] + src[y1 * src_width + x1]) * 0.25f;
+            }
+        }
+        l->mips[l->mip_count] = dst;
+        l->mip_widths[l->mip_count] = width;
+        l->mip_heights[l->mip_count] = height;
+        ++l->mip_count;
+    }
+    return 0;
+}
 
-    pipe(selfpipe);
+static void set_layer_defaults(struct style_layer* l) {
+    l->radius = options.radius;
+    l->width = l->type == LAYER_RING ? (options.outline ? options.outline : 2) : l->type == LAYER_GLOW ? options.radius : 3;
+    l->offset_x = l->type == LAYER_SHADOW ? 2 : 0;
+    l->offset_y = l->offset_x;
+    l->alpha = l->type == LAYER_GLOW || l->type == LAYER_SHADOW ? 0.5 : 1;
+    l->color_string = strdup(l->type == LAYER_SHADOW ? "black" : l->type == LAYER_IMAGE ? "white" : "state");
+}
 
-    while (1) {
-        XFlush(dpy);
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        FD_SET(selfpipe[0], &fds);
-        timeout.tv_usec = 0;
-        timeout.tv_sec = options.hide_timeout;
-        n = select((fd > selfpipe[0] ? fd : selfpipe[0]) + 1, &fds, NULL, NULL, &timeout);
-        if (n < 0) {
-            if (errno != EINTR) {
-                perror("select() failed");
-            }
+/* sprites grow to fit everything drawn */
+static void fit_layer(const struct style_layer* l) {
+    double extent = l->radius + 1;
+    if (l->type == LAYER_RING) {
+        extent += l->width / 2;
+    } else if (l->type == LAYER_GLOW) {
+        extent += l->width;
+    } else if (l->type == LAYER_SHADOW) {
+        extent += l->width + fmax(fabs(l->offset_x), fabs(l->offset_y));
+    }
+    if (extent > sprite_radius) {
+        sprite_radius = ceil(extent);
+    }
+}
+
+/* style of a single image layer, for --image */
+static int load_image_style(const char* filename) {
+    struct style_layer* l = &style_layers[0];
+    memset(l, 0, sizeof(*l));
+    l->type = LAYER_IMAGE;
+    set_layer_defaults(l);
+    if (load_image(l, filename)) {
+        return 1;
+    }
+    fit_layer(l);
+    style_layer_count = 1;
+    return 0;
+}
+
+/* lines are layers, from bottom to top, with optional settings:
+     fill|ring|glow|shadow|image [radius=R] [width=W] [offset=X,Y] [alpha=A]
+                                 [color=COLOR] [STATE=COLOR ...] [file=PNG|PAM]
+   where STATE is a color option name without "-color" (e.g. left),
+   COLOR "state" uses the color of the state, and lines starting with '#'
+   are comments */
+static int load_style(const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        perror(filename);
+        return 1;
+    }
+    char line[1024];
+    int line_number = 0;
+    int res = 0;
+    while (!res && fgets(line, sizeof(line), file)) {
+        char* token = strtok(line, " \t\n");
+        ++line_number;
+        if (!token || token[0] == '#') {
+            continue;
+        }
+        if (style_layer_count == STYLE_LAYERS) {
+            fprintf(stderr, "%s:%d: more than %d layers\n", filename, line_number, STYLE_LAYERS);
+            res = 1;
             break;
         }
-        if (n > 0) {
-            if (FD_ISSET(selfpipe[0], &fds)) {
+        struct style_layer* layer_p = &style_layers[style_layer_count];
+        memset(layer_p, 0, sizeof(*layer_p));
+        for (layer_p->type = 0; layer_p->type < LAYER_TYPES && strcmp(token, layer_names[layer_p->type]); ++layer_p->type) {
+        }
+        if (layer_p->type == LAYER_TYPES) {
+            fprintf(stderr, "%s:%d: unknown layer %s\n", filename, line_number, token);
+            res = 1;
+            break;
+        }
+        set_layer_defaults(layer_p);
+        ++style_layer_count; /* also when invalid, to be freed */
+        while (!res && (token = strtok(NULL, " \t\n"))) {
+            char* value = strchr(token, '=');
+            int option;
+            if (!value) {
+                fprintf(stderr, "%s:%d: invalid setting %s\n", filename, line_number, token);
+                res = 1;
                 break;
             }
-            while (XPending(dpy)) {
-                XNextEvent(dpy, &ev);
-
-                if (ev.type == GenericEvent) {
-                    cookie = &ev.xcookie;
-#if TARGET_FPS > 0
-                    if (!XGetEventData(dpy, cookie)) {
-                        continue;
-                    }
-                    const XIRawEvent* data = (const XIRawEvent*)cookie->data;
-                    if (data->time - lasttime <= 1000 / TARGET_FPS) {
-                        XFreeEventData(dpy, cookie);
-                        continue;
-                    }
-                    lasttime = data->time;
-                    XFreeEventData(dpy, cookie);
-#endif
-                    if (cookie->evtype == XI_RawMotion) {
-                        if (options.auto_hide_cursor && options.cursor_visible && !cursor_visible) {
-                            show_cursor();
-                        }
-                        if (options.auto_hide_highlight && options.highlight_visible && !highlight_visible) {
-                            show_highlight();
-                        } else if (highlight_visible) {
-                            get_pointer_position(&x, &y);
-                            XMoveWindow(dpy, win, x - total_radius - 1, y - total_radius - 1);
-                            /* unfortunately, this causes increase of the X server's cpu usage */
-                        }
-                        continue;
-                    }
-                    if (cookie->evtype == XI_RawButtonPress) {
-                        button_pressed = 1;
-                        redraw();
-                        continue;
-                    }
-                    if (cookie->evtype == XI_RawButtonRelease) {
-                        button_pressed = 0;
-                        redraw();
-                        continue;
-                    }
-                    continue;
+            *value++ = '\0';
+            if (!strcmp(token, "radius")) {
+                layer_p->radius = atof(value);
+            } else if (!strcmp(token, "width")) {
+                layer_p->width = atof(value);
+            } else if (!strcmp(token, "offset")) {
+                res = sscanf(value, "%lf,%lf", &layer_p->offset_x, &layer_p->offset_y) != 2;
+            } else if (!strcmp(token, "alpha")) {
+                layer_p->alpha = atof(value);
+                res = layer_p->alpha < 0 || layer_p->alpha > 1;
+            } else if (!strcmp(token, "color")) {
+                free(layer_p->color_string);
+                layer_p->color_string = strdup(value);
+            } else if (!strcmp(token, "file") && layer_p->type == LAYER_IMAGE) {
+                if (load_image(layer_p, value)) {
+                    res = 1;
+                    break;
+                }
+            } else {
+                for (option = 0; option < STATE_COUNT && (!color_option_names[option] || strcmp(token, color_option_names[option])); ++option) {
+                }
+                if (option == STATE_COUNT) {
+                    fprintf(stderr, "%s:%d: unknown setting %s\n", filename, line_number, token);
+                    res = 1;
+                    break;
                 }
+                layer_p->color_strings[option] = strdup(value);
+            }
+            if (res) {
+                fprintf(stderr, "%s:%d: invalid value %s\n", filename, line_number, value);
+            }
+        }
+        if (!res && layer_p->type == LAYER_IMAGE && !layer_p->mip_count) {
+            fprintf(stderr, "%s:%d: image layer needs a file\n", filename, line_number);
+            res = 1;
+        }
+        if (!res && (layer_p->radius < 0 || layer_p->width < 0)) {
+            fprintf(stderr, "%s:%d: negative radius or width\n", filename, line_number);
+            res = 1;
+        }
+        if (!res) {
+            fit_layer(layer_p);
+        }
+    }
+    fclose(file);
+    if (!res && !style_layer_count) {
+        fprintf(stderr, "%s: no layers\n", filename);
+        res = 1;
+    }
+    return res;
+}
+
+static double clamp01(double v) { return v < 0 ? 0 : v > 1 ? 1 : v; }
+
+/* coverage of a layer at offset dx, dy from the center, and color of image layers */
+static double get_layer_coverage(const struct style_layer* l, double dx, double dy, double scale, int hover, double* rgb) {
+    double radius = l->radius * scale;
+    double width = l->width * scale;
+    double d;
+    switch (l->type) {
+        case LAYER_FILL:
+            d = hypot(dx, dy);
+            if (hover) {
+                /* pen hover shows fills as rings */
+                return clamp01(PEN_HOVER_OUTLINE / 2.0 + 0.5 - fabs(d - radius + PEN_HOVER_OUTLINE / 2.0));
+            }
+            return clamp01(radius + 1 - d);
+        case LAYER_RING:
+            d = hypot(dx, dy);
+            return clamp01(width / 2 + 0.5 - fabs(d - radius - 0.5));
+        case LAYER_GLOW:
+            d = hypot(dx, dy) - radius;
+            return d <= 0 ? 1 : d >= width ? 0 : (1 - d / width) * (1 - d / width);
+        case LAYER_SHADOW: {
+            d = hypot(dx - l->offset_x * scale, dy - l->offset_y * scale);
+            if (width < 1) {
+                return clamp01(radius + 1 - d);
+            }
+            double t = clamp01((d - radius + width) / (2 * width));
+            return 1 - t * t * (3 - 2 * t);
+        }
+        case LAYER_IMAGE: {
+            /* bilinear, from the smallest level still at least the diameter */
+            double diameter = 2 * radius + 1;
+            int m = 0;
+            while (m + 1 < l->mip_count && l->mip_widths[m + 1] >= diameter && l->mip_heights[m + 1] >= diameter) {
+                ++m;
+            }
+            int w = l->mip_widths[m];
+            int h = l->mip_heights[m];
+            double u = (dx + radius + 0.5) / diameter;
+            double v = (dy + radius + 0.5) / diameter;
+            if (u < 0 || v < 0 || u >= 1 || v >= 1) {
+                return 0;
+            }
+            u = u * w - 0.5;
+            v = v * h - 0.5;
+            int x0 = floor(u);
+            int y0 = floor(v);
+            float fx = u - x0;
+            float fy = v - y0;
+            int x1 = x0 + 1 < w ? x0 + 1 : w - 1;
+            int y1 = y0 + 1 < h ? y0 + 1 : h - 1;
+            x0 = x0 < 0 ? 0 : x0;
+            y0 = y0 < 0 ? 0 : y0;
+            const v4sf* p = l->mips[m];
+            v4sf c = (p[y0 * w + x0] * (1 - fx) + p[y0 * w + x1] * fx) * (1 - fy) + (p[y1 * w + x0] * (1 - fx) + p[y1 * w + x1] * fx) * fy;
+            if (c[3] <= 0) {
+                return 0;
+            }
+            for (int k = 0; k < 3; ++k) {
+                rgb[k] *= c[k] / c[3];
+            }
+            return c[3];
+        }
+    }
+    return 0;
+}
+
+/* arrow fills pixels whose centers are inside, as XFillPolygon does */
+static int in_arrow(const XPoint* points, double x, double y) {
+    int signs = 0;
+    for (int k = 0; k < 3; ++k) {
+        const XPoint* a = &points[k];
+        const XPoint* b = &points[(k + 1) % 3];
+        double e = (b->x - a->x) * (y - a->y) - (b->y - a->y) * (x - a->x);
+        signs |= e < 0 ? 1 : e > 0 ? 2 : 0;
+    }
+    return signs != 3;
+}
 
-                if (ev.type == KeyPress) {
-                    KeySym keysym = XLookupKeysym(&ev.xkey, 0);
-                    if (keysym != NoSymbol) {
-                        handle_key(keysym, ev.xkey.state);
+/* renders all states into premultiplied RGBA sprites, so that the style costs nothing after startup */
+static int compile_style() {
+    int size = 2 * sprite_radius + 2;
+    Colormap colormap = DefaultColormap(dpy, screen);
+    XPoint arrow[3];
+    if (DefaultVisual(dpy, screen)->class != TrueColor) {
+        fprintf(stderr, "Styles need a TrueColor visual\n");
+        return 1;
+    }
+    style_sprites = calloc((size_t)STATE_COUNT * size * size, 4);
+    float* rgba = calloc((size_t)size * size, 4 * sizeof(float));
+    if (!style_sprites || !rgba) {
+        fprintf(stderr, "Could not allocate sprites\n");
+        free(rgba);
+        return 1;
+    }
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        double scale = i >= STATE_PEN_CONTACT ? (i - STATE_PEN_CONTACT + 1.0) / PEN_LEVELS : 1;
+        memset(rgba, 0, (size_t)size * size * 4 * sizeof(float));
+        for (int l = 0; l < style_layer_count; ++l) {
+            const struct style_layer* l_p = &style_layers[l];
+            const char* color_string = l_p->color_strings[get_color_option(i, NULL, NULL)];
+            XColor color = states[i].color;
+            if (!color_string) {
+                color_string = l_p->color_string;
+            }
+            if (strcmp(color_string, "state") && !XParseColor(dpy, colormap, color_string, &color)) {
+                fprintf(stderr, "Can't parse color: %s\n", color_string);
+                free(rgba);
+                return 1;
+            }
+            for (int y = 0; y < size; ++y) {
+                for (int x = 0; x < size; ++x) {
+                    double rgb[3] = {color.red / 65535.0, color.green / 65535.0, color.blue / 65535.0};
+                    double a = l_p->alpha * get_layer_coverage(l_p, x - sprite_radius, y - sprite_radius, scale, i == STATE_PEN_HOVER, rgb);
+                    float* p = &rgba[4 * (y * size + x)];
+                    /* premultiplied over */
+                    for (int c = 0; c < 3; ++c) {
+                        p[c] = rgb[c] * a + p[c] * (1 - a);
                     }
-                    continue;
+                    p[3] = a + p[3] * (1 - a);
                 }
-                if (ev.type == Expose) {
-                    if (ev.xexpose.count < 1) {
-                        redraw();
+            }
+        }
+        unsigned char* sprite = &style_sprites[(size_t)i * size * size * 4];
+        if (i >= STATE_SCROLL_UP && i < STATE_PEN_HOVER) {
+            const XColor* c = &states[i].color;
+            float v = 299 * c->red + 587 * c->green + 114 * c->blue > 1000 * 32768 ? 0 : 1;
+            get_arrow((i - STATE_SCROLL_UP) / SCROLL_LEVELS, arrow);
+            for (int y = 0; y < size; ++y) {
+                for (int x = 0; x < size; ++x) {
+                    if (in_arrow(arrow, x + 0.5, y + 0.5)) {
+                        float* p = &rgba[4 * (y * size + x)];
+                        p[0] = p[1] = p[2] = v;
+                        p[3] = 1;
                     }
-                    continue;
-                }
-                if (ev.type == VisibilityNotify) {
-                    /* needed to deal with menus, etc. overlapping the hightlight win */
-                    XRaiseWindow(dpy, win);
-                    continue;
                 }
             }
+        }
+        for (int k = 0; k < size * size * 4; ++k) {
+            sprite[k] = rgba[k] * 255 + 0.5f;
+        }
+    }
+    free(rgba);
+    return 0;
+}
+
+/* layers are only needed until compiled */
+static void free_style_layers() {
+    for (int l = 0; l < style_layer_count; ++l) {
+        free(style_layers[l].color_string);
+        for (int option = 0; option < STATE_COUNT; ++option) {
+            free(style_layers[l].color_strings[option]);
+        }
+        for (int m = 0; m < style_layers[l].mip_count; ++m) {
+            free(style_layers[l].mips[m]);
+        }
+    }
+    style_layer_count = 0;
+}
+
+/* shape of state i, where its sprite is at least half opaque */
+static Pixmap create_sprite_mask(int i) {
+    int size = 2 * sprite_radius + 2;
+    const unsigned char* sprite = &style_sprites[(size_t)i * size * size * 4];
+    Pixmap mask = XCreatePixmap(dpy, root, size, size, 1);
+    GC mask_gc = XCreateGC(dpy, mask, 0, NULL);
+    XImage* image = XCreateImage(dpy, DefaultVisual(dpy, screen), 1, ZPixmap, 0, NULL, size, size, 8, 0);
+    image->data = calloc(image->bytes_per_line, size);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            XPutPixel(image, x, y, sprite[4 * (y * size + x) + 3] >= 128);
+        }
+    }
+    XPutImage(dpy, mask, mask_gc, image, 0, 0, 0, 0, size, size);
+    XDestroyImage(image);
+    XFreeGC(dpy, mask_gc);
+    return mask;
+}
+
+/* alpha of state i, for translucent layers with RENDER_LAYER */
+static Picture create_sprite_alpha(int i) {
+    int size = 2 * sprite_radius + 2;
+    const unsigned char* sprite = &style_sprites[(size_t)i * size * size * 4];
+    Pixmap pixmap = XCreatePixmap(dpy, root, size, size, 8);
+    GC alpha_gc = XCreateGC(dpy, pixmap, 0, NULL);
+    XImage* image = XCreateImage(dpy, DefaultVisual(dpy, screen), 8, ZPixmap, 0, NULL, size, size, 8, 0);
+    image->data = calloc(image->bytes_per_line, size);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            XPutPixel(image, x, y, sprite[4 * (y * size + x) + 3]);
+        }
+    }
+    XPutImage(dpy, pixmap, alpha_gc, image, 0, 0, 0, 0, size, size);
+    XDestroyImage(image);
+    XFreeGC(dpy, alpha_gc);
+    Picture picture = XRenderCreatePicture(dpy, pixmap, XRenderFindStandardFormat(dpy, PictStandardA8), 0, NULL);
+    XFreePixmap(dpy, pixmap);
+    return picture;
+}
+
+/* uploads the compiled sprite of state i, with straight colors as alpha comes from masks */
+static void upload_sprite(int i) {
+    int size = 2 * sprite_radius + 2;
+    const unsigned char* sprite = &style_sprites[(size_t)i * size * size * 4];
+    Visual* visual = DefaultVisual(dpy, screen);
+    XImage* image = XCreateImage(dpy, visual, DefaultDepth(dpy, screen), ZPixmap, 0, NULL, size, size, 32, 0);
+    image->data = malloc((size_t)image->bytes_per_line * size);
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            const unsigned char* p = &sprite[4 * (y * size + x)];
+            unsigned int a = p[3] ? p[3] : 255;
+            XPutPixel(image, x, y,
+                      to_channel(p[0] * 255 / a, visual->red_mask) | to_channel(p[1] * 255 / a, visual->green_mask) | to_channel(p[2] * 255 / a, visual->blue_mask));
+        }
+    }
+    XPutImage(dpy, states[i].pixmap, gc, image, 0, 0, 0, 0, size, size);
+    XDestroyImage(image);
+}
+
+/* creates masks, and resets state pixmaps to be rendered by prepare_state() */
+static void render_states() {
+    XGCValues gc_values;
+    XPoint arrow[3];
+
+    for (int d = 0; d < 4; ++d) {
+        if (style_sprites) {
+            scroll_masks[d] = create_sprite_mask(STATE_SCROLL_UP + d * SCROLL_LEVELS);
+            continue;
+        }
+        scroll_masks[d] = create_mask();
+        GC mask_gc = XCreateGC(dpy, scroll_masks[d], 0, &gc_values);
+        XSetForeground(dpy, mask_gc, 1);
+        get_arrow(d, arrow);
+        XFillPolygon(dpy, scroll_masks[d], mask_gc, arrow, 3, Convex, CoordModeOrigin);
+        XFreeGC(dpy, mask_gc);
+    }
+
+    for (int m = 0; m < PEN_MASKS; ++m) {
+        int radius, outline;
+        if (style_sprites) {
+            pen_masks[m] = create_sprite_mask(STATE_PEN_HOVER + m);
+            continue;
+        }
+        get_pen_dot(STATE_PEN_HOVER + m, &radius, &outline);
+        pen_masks[m] = create_mask_with_dot(radius, outline);
+    }
+
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        states[i].pixmap = None;
+        states[i].picture = None;
+        if (i >= STATE_PEN_HOVER) {
+            states[i].mask = pen_masks[i - STATE_PEN_HOVER];
+        } else if (i >= STATE_SCROLL_UP) {
+            states[i].mask = scroll_masks[(i - STATE_SCROLL_UP) / SCROLL_LEVELS];
         } else {
-            if (options.auto_hide_cursor && cursor_visible) {
-                hide_cursor();
-            }
-            if (options.auto_hide_highlight && highlight_visible) {
-                hide_highlight();
+            states[i].mask = None;
+        }
+    }
+}
+
+static void render_state(int i) {
+    int total_radius = sprite_radius;
+    XPoint arrow[3];
+    states[i].pixmap = XCreatePixmap(dpy, root, 2 * total_radius + 2, 2 * total_radius + 2, DefaultDepth(dpy, screen));
+    if (style_sprites) {
+        upload_sprite(i);
+        return;
+    }
+    XSetForeground(dpy, gc, BlackPixel(dpy, screen));
+    XFillRectangle(dpy, states[i].pixmap, gc, 0, 0, 2 * total_radius + 2, 2 * total_radius + 2);
+    XSetForeground(dpy, gc, states[i].color.pixel);
+    if (i >= STATE_PEN_HOVER) {
+        int radius, outline;
+        get_pen_dot(i, &radius, &outline);
+        draw_dot(states[i].pixmap, gc, radius, outline);
+    } else {
+        draw_dot(states[i].pixmap, gc, options.radius, options.outline);
+    }
+    if (i >= STATE_SCROLL_UP && i < STATE_PEN_HOVER) {
+        const XColor* c = &states[i].color;
+        /* arrow in black or white, whichever contrasts more */
+        XSetForeground(dpy, gc, 299 * c->red + 587 * c->green + 114 * c->blue > 1000 * 32768 ? BlackPixel(dpy, screen) : WhitePixel(dpy, screen));
+        get_arrow((i - STATE_SCROLL_UP) / SCROLL_LEVELS, arrow);
+        XFillPolygon(dpy, states[i].pixmap, gc, arrow, 3, Convex, CoordModeOrigin);
+    }
+}
+
+static unsigned long get_state_bytes() {
+    int size = 2 * sprite_radius + 2;
+    return (unsigned long)size * size * 4;
+}
+
+/* server bytes of masks and state pixmaps, counted locally to avoid a round trip */
+static unsigned long get_pixmap_bytes() {
+    int size = 2 * sprite_radius + 2;
+    unsigned long bytes = resources_ready ? MASK_PICTURES * (unsigned long)size * ((size + 7) / 8) : 0; /* masks */
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        if (states[i].pixmap) {
+            bytes += get_state_bytes();
+        }
+    }
+    return bytes;
+}
+
+static void evict_state(int i) {
+    if (states[i].picture) {
+        XRenderFreePicture(dpy, states[i].picture);
+        states[i].picture = None;
+    }
+    XFreePixmap(dpy, states[i].pixmap);
+    states[i].pixmap = None;
+}
+
+/* evicts least recently used state pixmaps other than the current one and keep until below cap */
+static void enforce_pixmap_cap(int keep) {
+    unsigned long bytes = get_pixmap_bytes();
+    while (bytes > (unsigned long)options.pixmap_cap * 1024) {
+        int lru = -1;
+        for (int i = 0; i < STATE_COUNT; ++i) {
+            if (states[i].pixmap && i != current_state && i != keep && (lru < 0 || states[i].last_used < states[lru].last_used)) {
+                lru = i;
             }
         }
+        if (lru < 0) {
+            return;
+        }
+        evict_state(lru);
+        bytes -= bytes > get_state_bytes() ? get_state_bytes() : bytes;
     }
 }
 
-static int init_colors() {
-    int res;
+/* makes sure the pixmap (and picture) of state i is rendered */
+static void prepare_state(int i) {
+    states[i].last_used = ++state_clock;
+    if (!states[i].pixmap) {
+        render_state(i);
+        if (options.pixmap_cap) {
+            enforce_pixmap_cap(i);
+        }
+    }
+    if (render_mode == RENDER_LAYER && !states[i].picture) {
+        states[i].picture = XRenderCreatePicture(dpy, states[i].pixmap, sprite_format, 0, NULL);
+    }
+}
 
-    Colormap colormap = DefaultColormap(dpy, screen);
+static void free_states() {
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        if (states[i].pixmap) {
+            XFreePixmap(dpy, states[i].pixmap);
+        }
+    }
+    for (int d = 0; d < 4; ++d) {
+        XFreePixmap(dpy, scroll_masks[d]);
+    }
+    for (int m = 0; m < PEN_MASKS; ++m) {
+        XFreePixmap(dpy, pen_masks[m]);
+    }
+    XFreePixmap(dpy, dot_mask);
+}
+
+/* as far as the pixmap cap allows */
+static void render_all_states() {
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        if (options.pixmap_cap && get_pixmap_bytes() + get_state_bytes() > (unsigned long)options.pixmap_cap * 1024) {
+            break;
+        }
+        prepare_state(i);
+    }
+}
+
+static int create_resources() {
+    long long start = get_time();
+    int res = init_window();
+    if (res) {
+        return res;
+    }
+    render_states();
+    resources_ready = 1;
+    /* render all states up front, so that switching states never draws */
+    render_all_states();
+    ++resources_created;
+    /* requests are only queued so far, the time includes the server executing them */
+    XSync(dpy, False);
+    resources_creation_time = get_time() - start;
+    if (resources_created > 1 && resources_creation_time > 1000000 / options.frame_rate) {
+        fprintf(stderr, "Re-creating resources took %lld us, longer than a frame\n", resources_creation_time);
+    }
+    return 0;
+}
+
+/* frees state pixmaps, and window, GC, and masks if the highlight window is not mapped */
+static void release_resources() {
+    if (render_mode == RENDER_WINDOW && highlight_mapped && !highlight_visible && opacity == 0) {
+        /* faded out, but kept mapped for fading in again */
+        XUnmapWindow(dpy, win);
+        highlight_mapped = 0;
+    }
+    int release_all = render_mode == RENDER_WINDOW && !highlight_mapped;
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        if (states[i].pixmap && (release_all || i != current_state)) {
+            evict_state(i);
+        }
+    }
+    free_inactive_presets(release_all);
+    if (release_all && resources_ready) {
+        free_states();
+        XFreeGC(dpy, gc);
+        XDestroyWindow(dpy, win);
+        win = 0;
+        current_state = -1;
+        current_mask = None;
+        resources_ready = 0;
+    }
+}
+
+/* X-Resource counts of this client's server resources by type, for stats output */
+static void print_server_resources(FILE* out) {
+    XResType* types;
+    unsigned long bytes = 0;
+    int n;
+    if (!xres_available || !XResQueryClientResources(dpy, client_xid, &n, &types)) {
+        return;
+    }
+    fprintf(out, "server resources:");
+    for (int i = 0; i < n; ++i) {
+        char* name = XGetAtomName(dpy, types[i].resource_type);
+        fprintf(out, " %u %s%s", types[i].count, name ? name : "?", i + 1 < n ? "," : "");
+        XFree(name);
+    }
+    XFree(types);
+    XResQueryClientPixmapBytes(dpy, client_xid, &bytes);
+    fprintf(out, "; %lu pixmap bytes\n", bytes);
+}
 
-    res = XAllocNamedColor(dpy, colormap, options.pressed_color_string, &pressed_color, &pressed_color);
-    if (!res) {
-        fprintf(stderr, "Can't allocate color: %s\n", options.pressed_color_string);
+static Window create_argb_window(XVisualInfo* vinfo, long event_mask) {
+    if (!XMatchVisualInfo(dpy, screen, 32, TrueColor, vinfo)) {
+        fprintf(stderr, "No ARGB visual available\n");
+        return None;
+    }
+    XSetWindowAttributes win_attributes;
+    win_attributes.colormap = XCreateColormap(dpy, root, vinfo->visual, AllocNone);
+    win_attributes.background_pixel = 0;
+    win_attributes.border_pixel = 0;
+    win_attributes.event_mask = event_mask;
+    win_attributes.override_redirect = True;
+    Window w = XCreateWindow(dpy, root, 0, 0, DisplayWidth(dpy, screen), DisplayHeight(dpy, screen), 0, 32, InputOutput, vinfo->visual,
+                             CWColormap | CWBackPixel | CWBorderPixel | CWEventMask | CWOverrideRedirect, &win_attributes);
+    if (!w) {
+        fprintf(stderr, "Can't create layer window\n");
+        return None;
+    }
+    XStoreName(dpy, w, "highlight-pointer");
+    XFixesSetWindowShapeRegion(dpy, w, ShapeInput, 0, 0, empty_region);
+    return w;
+}
+
+static unsigned int heat_color(float v) {
+    float i = 1 - expf(-v / HEATMAP_SATURATION);
+    float a = i * HEATMAP_ALPHA;
+    /* blue over green to red, premultiplied */
+    unsigned int r = 255 * a * i;
+    unsigned int g = 255 * a * (1 - fabsf(2 * i - 1));
+    unsigned int b = 255 * a * (1 - i);
+    return (unsigned int)(255 * a) << 24 | r << 16 | g << 8 | b;
+}
+
+static void add_heat(int x, int y) {
+    if (!heatmap || x < 0 || y < 0 || x >= DisplayWidth(dpy, screen) || y >= DisplayHeight(dpy, screen)) {
+        return;
+    }
+    long long now = get_time();
+    int cx = x / HEATMAP_CELL;
+    int cy = y / HEATMAP_CELL;
+    int i = cy * heatmap_width + cx;
+    heatmap[i] = heatmap[i] * exp(-(now - heatmap_time[i]) / (options.heatmap_decay * 1e6)) + 1;
+    heatmap_time[i] = now;
+    int t = cy / HEATMAP_TILE * heatmap_tiles_x + cx / HEATMAP_TILE;
+    heatmap_tiles[t].dirty = 1;
+    heatmap_tiles[t].active = 1;
+    request_frame();
+}
+
+/* decays the tile's cells to now, uploads them at cell resolution, and scales them up into the heatmap window */
+static void render_heat_tile(int t, long long now) {
+    int cx0 = t % heatmap_tiles_x * HEATMAP_TILE;
+    int cy0 = t / heatmap_tiles_x * HEATMAP_TILE;
+    int w = heatmap_width - cx0 < HEATMAP_TILE ? heatmap_width - cx0 : HEATMAP_TILE;
+    int h = heatmap_height - cy0 < HEATMAP_TILE ? heatmap_height - cy0 : HEATMAP_TILE;
+    float max = 0;
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            int i = (cy0 + y) * heatmap_width + cx0 + x;
+            if (heatmap[i] > 0) {
+                heatmap[i] *= exp(-(now - heatmap_time[i]) / (options.heatmap_decay * 1e6));
+                heatmap_time[i] = now;
+                if (heatmap[i] > max) {
+                    max = heatmap[i];
+                }
+            }
+            heatmap_tile_data[y * HEATMAP_TILE + x] = heat_color(heatmap[i]);
+        }
+    }
+    XPutImage(dpy, heatmap_pixmap, heatmap_gc, heatmap_image, 0, 0, cx0, cy0, w, h);
+    XRenderComposite(dpy, PictOpSrc, heatmap_grid_picture, None, heatmap_picture, cx0 * HEATMAP_CELL, cy0 * HEATMAP_CELL, 0, 0, cx0 * HEATMAP_CELL,
+                     cy0 * HEATMAP_CELL, w * HEATMAP_CELL, h * HEATMAP_CELL);
+    heatmap_tiles[t].dirty = 0;
+    heatmap_tiles[t].rendered = now;
+    if (max < HEATMAP_MIN) {
+        /* fully transparent now, no more decay to show */
+        heatmap_tiles[t].active = 0;
+        for (int y = 0; y < h; ++y) {
+            memset(&heatmap[(cy0 + y) * heatmap_width + cx0], 0, w * sizeof(float));
+        }
+    }
+}
+
+/* renders at most HEATMAP_TILES_PER_FRAME tiles, changed ones and those due for showing decay; returns if more frames are needed */
+static int update_heatmap(long long now) {
+    int budget = HEATMAP_TILES_PER_FRAME;
+    int more = 0;
+    int count = heatmap_tiles_x * heatmap_tiles_y;
+    int start = heatmap_next_tile;
+    for (int n = 0; n < count; ++n) {
+        int t = (start + n) % count;
+        if (heatmap_tiles[t].dirty || (heatmap_tiles[t].active && now - heatmap_tiles[t].rendered >= HEATMAP_DECAY_INTERVAL)) {
+            if (!budget) {
+                more = 1;
+                break;
+            }
+            render_heat_tile(t, now);
+            --budget;
+            heatmap_next_tile = (t + 1) % count;
+        }
+        more |= heatmap_tiles[t].active;
+    }
+    return more;
+}
+
+static int init_heatmap() {
+    if (!compositor) {
+        fprintf(stderr, "Heatmap needs a compositing manager\n");
+        return 1;
+    }
+    if (!empty_region) {
+        XRectangle rect;
+        empty_region = XFixesCreateRegion(dpy, &rect, 0);
+    }
+    XVisualInfo vinfo;
+    heatmap_win = create_argb_window(&vinfo, ExposureMask);
+    if (!heatmap_win) {
         return 1;
     }
+    XRenderPictFormat* format = XRenderFindVisualFormat(dpy, vinfo.visual);
+    heatmap_picture = XRenderCreatePicture(dpy, heatmap_win, format, 0, NULL);
 
-    res = XAllocNamedColor(dpy, colormap, options.released_color_string, &released_color, &released_color);
-    if (!res) {
-        fprintf(stderr, "Can't allocate color: %s\n", options.released_color_string);
+    heatmap_width = (DisplayWidth(dpy, screen) + HEATMAP_CELL - 1) / HEATMAP_CELL;
+    heatmap_height = (DisplayHeight(dpy, screen) + HEATMAP_CELL - 1) / HEATMAP_CELL;
+    heatmap_tiles_x = (heatmap_width + HEATMAP_TILE - 1) / HEATMAP_TILE;
+    heatmap_tiles_y = (heatmap_height + HEATMAP_TILE - 1) / HEATMAP_TILE;
+    heatmap = calloc(heatmap_width * heatmap_height, sizeof(float));
+    heatmap_time = calloc(heatmap_width * heatmap_height, sizeof(long long));
+    heatmap_tiles = calloc(heatmap_tiles_x * heatmap_tiles_y, sizeof(*heatmap_tiles));
+    if (!heatmap || !heatmap_time || !heatmap_tiles) {
+        fprintf(stderr, "Could not allocate heatmap\n");
         return 1;
     }
 
+    /* at cell resolution, scaled up with bilinear filtering */
+    heatmap_pixmap = XCreatePixmap(dpy, root, heatmap_width, heatmap_height, 32);
+    heatmap_gc = XCreateGC(dpy, heatmap_pixmap, 0, NULL);
+    XRenderPictureAttributes attributes;
+    attributes.repeat = RepeatPad;
+    heatmap_grid_picture = XRenderCreatePicture(dpy, heatmap_pixmap, format, CPRepeat, &attributes);
+    XTransform transform = {{{XDoubleToFixed(1.0 / HEATMAP_CELL), 0, 0}, {0, XDoubleToFixed(1.0 / HEATMAP_CELL), 0}, {0, 0, XDoubleToFixed(1)}}};
+    XRenderSetPictureTransform(dpy, heatmap_grid_picture, &transform);
+    XRenderSetPictureFilter(dpy, heatmap_grid_picture, FilterBilinear, NULL, 0);
+    heatmap_image = XCreateImage(dpy, vinfo.visual, 32, ZPixmap, 0, (char*)heatmap_tile_data, HEATMAP_TILE, HEATMAP_TILE, 32, 0);
+
+    XMapWindow(dpy, heatmap_win);
+    if (render_mode == RENDER_LAYER) {
+        XWindowChanges changes;
+        changes.sibling = layer;
+        changes.stack_mode = Below;
+        XConfigureWindow(dpy, heatmap_win, CWSibling | CWStackMode, &changes);
+    }
     return 0;
 }
 
-static int grab_keys() {
-    /* after https://git.suckless.org/dwm/file/dwm.c.html */
-    numlockmask = 0;
-    unsigned int numlockkeycode = XKeysymToKeycode(dpy, XK_Num_Lock);
-    if (numlockkeycode) {
-        XModifierKeymap* modmap = XGetModifierMapping(dpy);
-        for (int i = 0; i < 8; ++i) {
-            for (int j = 0; j < modmap->max_keypermod; ++j) {
-                if (modmap->modifiermap[i * modmap->max_keypermod + j] == numlockkeycode) {
-                    numlockmask = (1 << i);
-                }
+static void free_heatmap() {
+    heatmap_image->data = NULL; /* static */
+    XDestroyImage(heatmap_image);
+    XRenderFreePicture(dpy, heatmap_grid_picture);
+    XFreeGC(dpy, heatmap_gc);
+    XFreePixmap(dpy, heatmap_pixmap);
+    XRenderFreePicture(dpy, heatmap_picture);
+    XDestroyWindow(dpy, heatmap_win);
+    free(heatmap);
+    free(heatmap_time);
+    free(heatmap_tiles);
+    if (render_mode == RENDER_WINDOW) {
+        XFixesDestroyRegion(dpy, empty_region);
+        empty_region = None;
+    }
+}
+
+/* alpha or shape of states as pictures, for RENDER_LAYER */
+static void create_mask_pictures() {
+    XRenderPictFormat* mask_format = XRenderFindStandardFormat(dpy, PictStandardA1);
+    if (style_sprites) {
+        /* alpha rather than shape, for translucent layers */
+        mask_pictures[0] = create_sprite_alpha(STATE_RELEASED);
+        for (int d = 0; d < 4; ++d) {
+            mask_pictures[d + 1] = create_sprite_alpha(STATE_SCROLL_UP + d * SCROLL_LEVELS);
+        }
+        for (int m = 0; m < PEN_MASKS; ++m) {
+            mask_pictures[m + 5] = create_sprite_alpha(STATE_PEN_HOVER + m);
+        }
+    } else {
+        mask_pictures[0] = XRenderCreatePicture(dpy, dot_mask, mask_format, 0, NULL);
+        for (int d = 0; d < 4; ++d) {
+            mask_pictures[d + 1] = XRenderCreatePicture(dpy, scroll_masks[d], mask_format, 0, NULL);
+        }
+        for (int m = 0; m < PEN_MASKS; ++m) {
+            mask_pictures[m + 5] = XRenderCreatePicture(dpy, pen_masks[m], mask_format, 0, NULL);
+        }
+    }
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        states[i].mask_picture = mask_pictures[0];
+        for (int d = 0; d < 4; ++d) {
+            if (states[i].mask == scroll_masks[d]) {
+                states[i].mask_picture = mask_pictures[d + 1];
+            }
+        }
+        for (int m = 0; m < PEN_MASKS; ++m) {
+            if (states[i].mask == pen_masks[m]) {
+                states[i].mask_picture = mask_pictures[m + 5];
             }
         }
-        XFreeModifiermap(modmap);
     }
+}
 
-    unsigned int modifiers[] = {0, LockMask, numlockmask, numlockmask | LockMask};
-    for (int i = 0; i < KEY_ARRAY_SIZE; ++i) {
-        if (keys[i].keysym != NoSymbol) {
-            KeyCode c = XKeysymToKeycode(dpy, keys[i].keysym);
-            if (!c) {
-                fprintf(stderr, "Could not convert key to keycode\n");
-                return 1;
-            }
-            for (int j = 0; j < 2; ++j) {
-                XGrabKey(dpy, c, keys[i].modifiers | modifiers[j], root, 1, GrabModeAsync, GrabModeAsync);
+static int init_layer() {
+    XRectangle rect;
+    if (!empty_region) {
+        empty_region = XFixesCreateRegion(dpy, &rect, 0);
+    }
+
+    if (!compositor) {
+        int event, error;
+        if (!XCompositeQueryExtension(dpy, &event, &error)) {
+            fprintf(stderr, "Composite extension not supported\n");
+            return 1;
+        }
+        layer = XCompositeGetOverlayWindow(dpy, root);
+        XFixesSetWindowShapeRegion(dpy, layer, ShapeBounding, 0, 0, empty_region);
+        XFixesSetWindowShapeRegion(dpy, layer, ShapeInput, 0, 0, empty_region);
+        render_mode = RENDER_OVERLAY;
+        return 0;
+    }
+
+    XVisualInfo vinfo;
+    layer = create_argb_window(&vinfo, VisibilityChangeMask);
+    if (!layer) {
+        return 1;
+    }
+    layer_picture = XRenderCreatePicture(dpy, layer, XRenderFindVisualFormat(dpy, vinfo.visual), 0, NULL);
+
+    sprite_format = XRenderFindVisualFormat(dpy, DefaultVisual(dpy, screen));
+    create_mask_pictures();
+    XMapWindow(dpy, layer);
+    highlight_mapped = 1;
+    render_mode = RENDER_LAYER;
+    return 0;
+}
+
+static void free_layer() {
+    if (render_mode == RENDER_OVERLAY) {
+        XFixesSetWindowShapeRegion(dpy, layer, ShapeBounding, 0, 0, None);
+        XCompositeReleaseOverlayWindow(dpy, root);
+    } else {
+        for (int i = 0; i < STATE_COUNT; ++i) {
+            if (states[i].picture) {
+                XRenderFreePicture(dpy, states[i].picture);
+                states[i].picture = None;
+            }
+        }
+        for (int d = 0; d < MASK_PICTURES; ++d) {
+            XRenderFreePicture(dpy, mask_pictures[d]);
+        }
+        XRenderFreePicture(dpy, layer_picture);
+        layer_picture = None;
+        XDestroyWindow(dpy, layer);
+    }
+    /* reset, as the heatmap shares the region, also after benchmark_render() */
+    XFixesDestroyRegion(dpy, empty_region);
+    empty_region = None;
+}
+
+static int get_state() {
+    static const int button_states[] = {STATE_LEFT, STATE_MIDDLE, STATE_RIGHT};
+    if (pen_active && !(buttons & ~(1u << 1))) {
+        /* the pen tip also presses the first button */
+        if (pen_pressure < PEN_CONTACT_PRESSURE) {
+            return STATE_PEN_HOVER;
+        }
+        int level = pen_pressure * PEN_LEVELS;
+        return STATE_PEN_CONTACT + (level < PEN_LEVELS ? level : PEN_LEVELS - 1);
+    }
+    for (int i = 1; i <= 3; ++i) {
+        if (buttons & (1u << i)) {
+            return button_states[i - 1];
+        }
+    }
+    if (buttons) {
+        return STATE_PRESSED;
+    }
+    if (scroll_intensity >= SCROLL_THRESHOLD) {
+        int level = scroll_intensity;
+        return scroll_state + (level < SCROLL_LEVELS ? level : SCROLL_LEVELS - 1);
+    }
+    if (held_modifiers & ControlMask) {
+        return STATE_CTRL;
+    }
+    if (held_modifiers & ShiftMask) {
+        return STATE_SHIFT;
+    }
+    return STATE_RELEASED;
+}
+
+/* switching state only swaps the window background, nothing is rasterized */
+static void set_state(int state) {
+    if (state != current_state) {
+        prepare_state(state);
+    }
+    if (state != current_state && render_mode != RENDER_WINDOW) {
+        current_state = state;
+        if (highlight_visible) {
+            paint_highlight(drawn_x, drawn_y);
+        }
+    } else if (state != current_state) {
+        Pixmap mask = states[state].mask ? states[state].mask : dot_mask;
+        current_state = state;
+        if (mask != current_mask) {
+            XShapeCombineMask(dpy, win, ShapeBounding, 0, 0, mask, ShapeSet);
+            current_mask = mask;
+        }
+        XSetWindowBackgroundPixmap(dpy, win, states[state].pixmap);
+        XClearWindow(dpy, win);
+    }
+}
+static void update_state() {
+    if (resources_ready) {
+        set_state(get_state());
+    }
+}
+
+/* scroll events are only accumulated here and shown on the next frame */
+static void add_scroll(int axis, double amount) {
+    scroll_amount[axis] += amount;
+    request_frame();
+}
+
+/* returns 1 if another frame is needed */
+static int update_scroll(double dt) {
+    double v = scroll_amount[0];
+    double h = scroll_amount[1];
+    if (v != 0 || h != 0) {
+        if (fabs(v) >= fabs(h)) {
+            scroll_state = v < 0 ? STATE_SCROLL_UP : STATE_SCROLL_DOWN;
+        } else {
+            scroll_state = h < 0 ? STATE_SCROLL_LEFT : STATE_SCROLL_RIGHT;
+        }
+        scroll_intensity += fabs(v) + fabs(h);
+        scroll_amount[0] = 0;
+        scroll_amount[1] = 0;
+    } else {
+        scroll_intensity *= exp(-dt / SCROLL_DECAY);
+        if (scroll_intensity < SCROLL_THRESHOLD) {
+            scroll_intensity = 0;
+        }
+    }
+    update_state();
+    return scroll_intensity > 0;
+}
+
+/* looks up valuator number in the values of the event, returns 0 if absent */
+static int get_valuator(const XIRawEvent* raw, const double* values, int number, double* value) {
+    const double* v = values;
+    for (int i = 0; i < raw->valuators.mask_len * 8 && i <= number; ++i) {
+        if (XIMaskIsSet(raw->valuators.mask, i)) {
+            if (i == number) {
+                *value = *v;
+                return 1;
+            }
+            ++v;
+        }
+    }
+    return 0;
+}
+
+static void handle_touch(int evtype, const XIRawEvent* raw) {
+    int d = raw->sourceid;
+    int slot = -1;
+    if (d < 0 || d >= MAX_DEVICES || !devices[d].direct_touch) {
+        return;
+    }
+    for (int i = 0; i < TOUCH_SLOTS; ++i) {
+        if (touches[i].active && touches[i].id == raw->detail) {
+            slot = i;
+            break;
+        }
+    }
+    if (evtype == XI_RawTouchBegin && slot < 0) {
+        for (int i = 0; i < TOUCH_SLOTS; ++i) {
+            if (!touches[i].active) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot < 0) {
+            /* more fingers than slots */
+            return;
+        }
+        touches[slot].active = 1;
+        touches[slot].id = raw->detail;
+        touches[slot].position[0] = 0;
+        touches[slot].position[1] = 0;
+    } else if (slot < 0) {
+        return;
+    }
+    if (evtype == XI_RawTouchEnd) {
+        touches[slot].active = 0;
+    } else {
+        /* absolute device coordinates, transformed as the server does for the pointer */
+        double value;
+        for (int k = 0; k < 2; ++k) {
+            if (get_valuator(raw, raw->raw_values, devices[d].touch_valuators[k], &value)) {
+                touches[slot].position[k] = (value - devices[d].touch_min[k]) / (devices[d].touch_max[k] - devices[d].touch_min[k]);
+            }
+        }
+        const float* m = devices[d].transform;
+        double u = touches[slot].position[0];
+        double v = touches[slot].position[1];
+        double w = m[6] * u + m[7] * v + m[8];
+        if (w != 0) {
+            touches[slot].x = (m[0] * u + m[1] * v + m[2]) / w * DisplayWidth(dpy, screen);
+            touches[slot].y = (m[3] * u + m[4] * v + m[5]) / w * DisplayHeight(dpy, screen);
+        }
+    }
+    touches[slot].dirty = 1;
+    request_frame();
+}
+
+/* at most one request per touch and frame, however many updates came in */
+static void update_touches() {
+    int total_radius = sprite_radius;
+    for (int i = 0; i < TOUCH_SLOTS; ++i) {
+        if (!touches[i].dirty) {
+            continue;
+        }
+        touches[i].dirty = 0;
+        if (touches[i].active) {
+            XMoveWindow(dpy, touches[i].win, touches[i].x - total_radius - 1, touches[i].y - total_radius - 1);
+            if (!touches[i].mapped) {
+                XMapRaised(dpy, touches[i].win);
+                touches[i].mapped = 1;
+            }
+        } else if (touches[i].mapped) {
+            XUnmapWindow(dpy, touches[i].win);
+            touches[i].mapped = 0;
+        }
+    }
+}
+
+/* window showing the left button state, for touches and gestures */
+static void set_dot_window(Window w) {
+    prepare_state(STATE_LEFT);
+    XResizeWindow(dpy, w, 2 * sprite_radius + 2, 2 * sprite_radius + 2);
+    XShapeCombineMask(dpy, w, ShapeBounding, 0, 0, dot_mask, ShapeSet);
+    XSetWindowBackgroundPixmap(dpy, w, states[STATE_LEFT].pixmap);
+    XClearWindow(dpy, w);
+}
+
+static Window create_dot_window() {
+    Window w = create_highlight_window(NoEventMask);
+    if (w) {
+        set_dot_window(w);
+    }
+    return w;
+}
+
+/* pool of windows, one per slot */
+static int init_touch() {
+    for (int i = 0; i < TOUCH_SLOTS; ++i) {
+        touches[i].win = create_dot_window();
+        if (!touches[i].win) {
+            return 1;
+        }
+        touches[i].active = 0;
+        touches[i].mapped = 0;
+        touches[i].dirty = 0;
+    }
+    return 0;
+}
+
+static void free_touch() {
+    for (int i = 0; i < TOUCH_SLOTS; ++i) {
+        XDestroyWindow(dpy, touches[i].win);
+    }
+}
+
+static void handle_gesture(int evtype, const void* event) {
+    switch (evtype) {
+        case XI_GesturePinchBegin:
+        case XI_GesturePinchUpdate:
+        case XI_GesturePinchEnd: {
+            const XIGesturePinchEvent* pinch = (const XIGesturePinchEvent*)event;
+            if (evtype == XI_GesturePinchBegin) {
+                gesture.x = pinch->root_x;
+                gesture.y = pinch->root_y;
+            }
+            gesture.active = evtype != XI_GesturePinchEnd;
+            gesture.fingers = pinch->detail;
+            gesture.scale = pinch->scale;
+            gesture.dx = 0;
+            gesture.dy = 0;
+        } break;
+        case XI_GestureSwipeBegin:
+        case XI_GestureSwipeUpdate:
+        case XI_GestureSwipeEnd: {
+            const XIGestureSwipeEvent* swipe = (const XIGestureSwipeEvent*)event;
+            if (evtype == XI_GestureSwipeBegin) {
+                gesture.x = swipe->root_x;
+                gesture.y = swipe->root_y;
+                gesture.dx = 0;
+                gesture.dy = 0;
+            }
+            gesture.active = evtype != XI_GestureSwipeEnd;
+            gesture.fingers = swipe->detail;
+            gesture.scale = 1;
+            gesture.dx += swipe->delta_x;
+            gesture.dy += swipe->delta_y;
+        } break;
+        default:
+            return;
+    }
+    gesture.dirty = 1;
+    request_frame();
+}
+
+/* fingers on a circle around the anchor, sized by pinch scale and
+   shifted by swipe distance, updated at most once per frame */
+static void update_gesture() {
+    int total_radius = sprite_radius;
+    double spread;
+    if (!gesture.dirty) {
+        return;
+    }
+    gesture.dirty = 0;
+    spread = GESTURE_SPREAD * total_radius * gesture.scale;
+    if (spread > DisplayHeight(dpy, screen) / 2) {
+        spread = DisplayHeight(dpy, screen) / 2;
+    }
+    for (int i = 0; i < GESTURE_FINGERS; ++i) {
+        if (gesture.active && i < gesture.fingers) {
+            double angle = 2 * M_PI * i / gesture.fingers - M_PI / 2;
+            int x = gesture.x + gesture.dx + spread * cos(angle);
+            int y = gesture.y + gesture.dy + spread * sin(angle);
+            XMoveWindow(dpy, gesture.win[i], x - total_radius - 1, y - total_radius - 1);
+            if (!(gesture.mapped & (1u << i))) {
+                XMapRaised(dpy, gesture.win[i]);
+                gesture.mapped |= 1u << i;
+            }
+        } else if (gesture.mapped & (1u << i)) {
+            XUnmapWindow(dpy, gesture.win[i]);
+            gesture.mapped &= ~(1u << i);
+        }
+    }
+}
+
+static int init_gestures() {
+    for (int i = 0; i < GESTURE_FINGERS; ++i) {
+        gesture.win[i] = create_dot_window();
+        if (!gesture.win[i]) {
+            return 1;
+        }
+    }
+    gesture.active = 0;
+    gesture.mapped = 0;
+    gesture.dirty = 0;
+    return 0;
+}
+
+static void free_gestures() {
+    for (int i = 0; i < GESTURE_FINGERS; ++i) {
+        XDestroyWindow(dpy, gesture.win[i]);
+    }
+}
+
+/* resources of a preset, swapped in and out of the globals they are drawn from */
+static struct preset {
+    struct state states[STATE_COUNT];
+    Pixmap dot_mask;
+    Pixmap scroll_masks[4];
+    Pixmap pen_masks[PEN_MASKS];
+    Picture mask_pictures[MASK_PICTURES];
+    unsigned char* style_sprites;
+    int sprite_radius;
+} presets[PRESETS_SIZE + 1]; /* first one from the command line */
+static int preset_count = 0;
+static int current_preset = 0;
+
+static void save_preset(struct preset* p) {
+    memcpy(p->states, states, sizeof(states));
+    p->dot_mask = dot_mask;
+    memcpy(p->scroll_masks, scroll_masks, sizeof(scroll_masks));
+    memcpy(p->pen_masks, pen_masks, sizeof(pen_masks));
+    memcpy(p->mask_pictures, mask_pictures, sizeof(mask_pictures));
+    p->style_sprites = style_sprites;
+    p->sprite_radius = sprite_radius;
+}
+
+static void restore_preset(const struct preset* p) {
+    memcpy(states, p->states, sizeof(states));
+    dot_mask = p->dot_mask;
+    memcpy(scroll_masks, p->scroll_masks, sizeof(scroll_masks));
+    memcpy(pen_masks, p->pen_masks, sizeof(pen_masks));
+    memcpy(mask_pictures, p->mask_pictures, sizeof(mask_pictures));
+    style_sprites = p->style_sprites;
+    sprite_radius = p->sprite_radius;
+}
+
+/* masks, mask pictures, and state pixmaps of the current preset */
+static void build_preset_resources() {
+    dot_mask = create_mask();
+    render_states();
+    if (render_mode == RENDER_LAYER) {
+        create_mask_pictures();
+    }
+    render_all_states();
+}
+
+/* frees state pixmaps of all but the current preset, and with all also
+   their masks and mask pictures, which are rebuilt when switched to */
+static void free_inactive_presets(int all) {
+    if (preset_count < 2) {
+        return;
+    }
+    save_preset(&presets[current_preset]);
+    for (int p = 0; p < preset_count; ++p) {
+        if (p == current_preset || !presets[p].dot_mask) {
+            continue;
+        }
+        restore_preset(&presets[p]);
+        for (int i = 0; i < STATE_COUNT; ++i) {
+            if (states[i].pixmap) {
+                evict_state(i);
+            }
+        }
+        if (all) {
+            free_states();
+            if (render_mode == RENDER_LAYER) {
+                for (int m = 0; m < MASK_PICTURES; ++m) {
+                    XRenderFreePicture(dpy, mask_pictures[m]);
+                }
+            }
+            dot_mask = None;
+        }
+        save_preset(&presets[p]);
+    }
+    restore_preset(&presets[current_preset]);
+}
+
+/* builds masks and pixmaps of all presets on startup, so that switching
+   never draws, compiles, or allocates colors; the pixmap cap applies to
+   each preset on its own */
+static int build_presets() {
+    save_preset(&presets[0]);
+    for (int p = 0; p < options.preset_files_count; ++p) {
+        style_sprites = NULL;
+        sprite_radius = options.radius + options.outline;
+        int res = load_style(options.preset_files[p]) || compile_style();
+        free_style_layers();
+        if (res) {
+            return 1;
+        }
+        build_preset_resources();
+        save_preset(&presets[p + 1]);
+    }
+    restore_preset(&presets[0]);
+    preset_count = options.preset_files_count + 1;
+    return 0;
+}
+
+static void cycle_preset() {
+    if (preset_count < 2 || (!resources_ready && create_resources())) {
+        return;
+    }
+    if (render_mode != RENDER_WINDOW) {
+        erase_highlight();
+    }
+    save_preset(&presets[current_preset]);
+    current_preset = (current_preset + 1) % preset_count;
+    restore_preset(&presets[current_preset]);
+    if (!dot_mask) {
+        /* released while idle */
+        build_preset_resources();
+    } else {
+        render_all_states();
+    }
+
+    XResizeWindow(dpy, win, 2 * sprite_radius + 2, 2 * sprite_radius + 2);
+    current_state = -1;
+    current_mask = None;
+    update_state();
+    if (render_mode == RENDER_WINDOW) {
+        /* keep centered at the new size */
+        if (options.smooth_follow) {
+            move_highlight(lround(highlight_x), lround(highlight_y));
+        } else {
+            move_highlight(pointer_x, pointer_y);
+        }
+    }
+    if (options.touch) {
+        for (int i = 0; i < TOUCH_SLOTS; ++i) {
+            set_dot_window(touches[i].win);
+            touches[i].dirty = 1;
+        }
+    }
+    if (options.gestures) {
+        for (int i = 0; i < GESTURE_FINGERS; ++i) {
+            set_dot_window(gesture.win[i]);
+        }
+        gesture.dirty = 1;
+    }
+    request_frame();
+}
+
+/* returns if the pointer moved, rather than only scrolled */
+static int handle_valuators(const XIRawEvent* raw) {
+    int moved = 0;
+    const double* value = raw->raw_values;
+    int d = raw->sourceid;
+    if (d < 0 || d >= MAX_DEVICES) {
+        return 1;
+    }
+    int was_pen = pen_active;
+    pen_active = devices[d].pressure_valuator >= 0;
+    for (int i = 0; i < raw->valuators.mask_len * 8; ++i) {
+        if (XIMaskIsSet(raw->valuators.mask, i)) {
+            if (i == devices[d].scroll_valuators[0]) {
+                add_scroll(0, *value / devices[d].scroll_increments[0]);
+            } else if (i == devices[d].scroll_valuators[1]) {
+                add_scroll(1, *value / devices[d].scroll_increments[1]);
+            } else if (i == devices[d].pressure_valuator) {
+                pen_pressure = (*value - devices[d].pressure_min) / (devices[d].pressure_max - devices[d].pressure_min);
+            } else if (i == devices[d].tilt_valuators[0] || i == devices[d].tilt_valuators[1]) {
+                int k = i == devices[d].tilt_valuators[1];
+                int* offset = k ? &pen_offset_y : &pen_offset_x;
+                int tilt_offset = lround(((*value - devices[d].tilt_min[k]) / (devices[d].tilt_max[k] - devices[d].tilt_min[k]) - 0.5) * options.radius);
+                /* tilting alone moves the highlight, too */
+                moved |= tilt_offset != *offset;
+                *offset = tilt_offset;
+            } else {
+                moved = 1;
+            }
+            ++value;
+        }
+    }
+    if (pen_active || was_pen) {
+        /* only switches between pre-rendered sizes */
+        update_state();
+    }
+    return moved;
+}
+
+static int init_keys() {
+    XSetWindowAttributes win_attributes;
+    win_attributes.override_redirect = True;
+    win_attributes.background_pixel = BlackPixel(dpy, screen);
+    win_attributes.event_mask = ExposureMask; /* e.g. when uncovered without a compositor */
+    keys_win = XCreateWindow(dpy, root, 0, 0, 1, 1, 0, DefaultDepth(dpy, screen), InputOutput, DefaultVisual(dpy, screen), CWOverrideRedirect | CWBackPixel | CWEventMask,
+                             &win_attributes);
+    if (!keys_win) {
+        fprintf(stderr, "Can't create keys window\n");
+        return 1;
+    }
+    XStoreName(dpy, keys_win, "highlight-pointer-keys");
+
+    /* let clicks fall through */
+    XRectangle rect;
+    XserverRegion region = XFixesCreateRegion(dpy, &rect, 1);
+    XFixesSetWindowShapeRegion(dpy, keys_win, ShapeInput, 0, 0, region);
+    XFixesDestroyRegion(dpy, region);
+
+    /* glyphs are cached server-side by Xft in XRender glyph sets */
+    keys_font = XftFontOpenName(dpy, screen, options.keys_font);
+    if (!keys_font) {
+        fprintf(stderr, "Can't open font: %s\n", options.keys_font);
+        return 1;
+    }
+    keys_draw = XftDrawCreate(dpy, keys_win, DefaultVisual(dpy, screen), DefaultColormap(dpy, screen));
+    if (!XftColorAllocName(dpy, DefaultVisual(dpy, screen), DefaultColormap(dpy, screen), "white", &keys_color)) {
+        fprintf(stderr, "Can't allocate color: white\n");
+        return 1;
+    }
+
+    XDisplayKeycodes(dpy, &keymap_min_keycode, &keymap_max_keycode);
+    keymap = XGetKeyboardMapping(dpy, keymap_min_keycode, keymap_max_keycode - keymap_min_keycode + 1, &keymap_width);
+    return 0;
+}
+
+static void free_keys() {
+    XftColorFree(dpy, DefaultVisual(dpy, screen), DefaultColormap(dpy, screen), &keys_color);
+    XftDrawDestroy(keys_draw);
+    XftFontClose(dpy, keys_font);
+    XDestroyWindow(dpy, keys_win);
+    XFree(keymap);
+}
+
+/* encode keysym as UTF-8 into buf if it is a printable character, returns length */
+static int keysym_to_utf8(KeySym keysym, char* buf) {
+    unsigned long c;
+    if (keysym > 0x20 && keysym < 0x7f) {
+        c = keysym;
+    } else if (keysym > 0xa0 && keysym <= 0xff) {
+        c = keysym;
+    } else if ((keysym & 0xff000000) == 0x01000000) {
+        c = keysym & 0x00ffffff;
+    } else {
+        return 0;
+    }
+    if (c < 0x80) {
+        buf[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        buf[0] = 0xc0 | (c >> 6);
+        buf[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if (c < 0x10000) {
+        buf[0] = 0xe0 | (c >> 12);
+        buf[1] = 0x80 | ((c >> 6) & 0x3f);
+        buf[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    buf[0] = 0xf0 | (c >> 18);
+    buf[1] = 0x80 | ((c >> 12) & 0x3f);
+    buf[2] = 0x80 | ((c >> 6) & 0x3f);
+    buf[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+static void add_key_label(int keycode) {
+    char text[KEYS_LABEL_SIZE];
+    char utf8[4];
+    int len, n = 0;
+    char* label;
+
+    if (keycode < keymap_min_keycode || keycode > keymap_max_keycode) {
+        return;
+    }
+    const KeySym* syms = &keymap[(keycode - keymap_min_keycode) * keymap_width];
+    KeySym keysym = (held_modifiers & ShiftMask) && keymap_width > 1 && syms[1] != NoSymbol ? syms[1] : syms[0];
+    if (keysym == NoSymbol) {
+        return;
+    }
+    len = keysym_to_utf8(keysym, utf8);
+
+    /* same notation as for hotkeys, shift is already part of printable characters */
+    for (int i = 0; i < KEY_MODMAP_SIZE; ++i) {
+        if ((held_modifiers & key_modifier_mapping[i].modifiers) && !(len && key_modifier_mapping[i].modifiers == ShiftMask)) {
+            text[n++] = key_modifier_mapping[i].symbol;
+            text[n++] = '-';
+        }
+    }
+    int plain = len && n == 0;
+    if (plain && keys_plain && keys_ring_count > 0) {
+        /* plain characters are appended to the previous label if it is plain as well */
+        label = keys_ring[(keys_ring_start + keys_ring_count - 1) % KEYS_RING_SIZE];
+        size_t used = strlen(label);
+        if (used + len < KEYS_LABEL_SIZE) {
+            memcpy(label + used, utf8, len);
+            label[used + len] = '\0';
+            keys_dirty = 1;
+            return;
+        }
+    }
+    if (len) {
+        memcpy(text + n, utf8, len);
+        text[n + len] = '\0';
+    } else {
+        /* XKeysymToString returns static strings for named keysyms */
+        const char* name = XKeysymToString(keysym);
+        if (!name) {
+            return;
+        }
+        snprintf(text + n, KEYS_LABEL_SIZE - n, "%s", name);
+    }
+    keys_plain = plain;
+
+    if (keys_ring_count == KEYS_RING_SIZE) {
+        keys_ring_start = (keys_ring_start + 1) % KEYS_RING_SIZE;
+    } else {
+        ++keys_ring_count;
+    }
+    label = keys_ring[(keys_ring_start + keys_ring_count - 1) % KEYS_RING_SIZE];
+    memcpy(label, text, KEYS_LABEL_SIZE);
+    keys_dirty = 1;
+}
+
+static void clear_keys() {
+    keys_ring_count = 0;
+    keys_plain = 0;
+    XUnmapWindow(dpy, keys_win);
+}
+
+/* labels only, onto the cleared window */
+static void draw_keys() {
+    XGlyphInfo extents;
+    int x = KEYS_PADDING;
+    for (int i = 0; i < keys_ring_count; ++i) {
+        const char* label = keys_ring[(keys_ring_start + i) % KEYS_RING_SIZE];
+        int len = strlen(label);
+        XftDrawStringUtf8(keys_draw, &keys_color, keys_font, x, KEYS_PADDING + keys_font->ascent, (const FcChar8*)label, len);
+        XftTextExtentsUtf8(dpy, keys_font, (const FcChar8*)label, len, &extents);
+        x += extents.xOff + KEYS_PADDING;
+    }
+}
+
+static void redraw_keys() {
+    XGlyphInfo extents;
+    int width = KEYS_PADDING;
+    int height = keys_font->ascent + keys_font->descent + 2 * KEYS_PADDING;
+    int x, y;
+
+    for (int i = 0; i < keys_ring_count; ++i) {
+        const char* label = keys_ring[(keys_ring_start + i) % KEYS_RING_SIZE];
+        XftTextExtentsUtf8(dpy, keys_font, (const FcChar8*)label, strlen(label), &extents);
+        width += extents.xOff + KEYS_PADDING;
+    }
+    if (options.keys_position == KEYS_POSITION_POINTER) {
+        x = pointer_x + 2 * sprite_radius;
+        y = pointer_y + 2 * sprite_radius;
+    } else {
+        x = (DisplayWidth(dpy, screen) - width) / 2;
+        y = options.keys_position == KEYS_POSITION_TOP ? KEYS_PADDING : DisplayHeight(dpy, screen) - height - 4 * KEYS_PADDING;
+    }
+    XMoveResizeWindow(dpy, keys_win, x, y, width, height);
+    XMapRaised(dpy, keys_win);
+    XClearWindow(dpy, keys_win);
+    draw_keys();
+    keys_dirty = 0;
+}
+
+static void handle_raw_key(int keycode, int pressed) {
+    for (int i = 0; i < MODIFIER_KEYS_SIZE; ++i) {
+        if (modifier_keys[i].keycode == keycode) {
+            if (pressed) {
+                held_modifiers |= modifier_keys[i].mask;
+            } else {
+                held_modifiers &= ~modifier_keys[i].mask;
+            }
+            update_state();
+            return;
+        }
+    }
+    if (pressed && options.hide_while_typing && !(held_modifiers & (ControlMask | Mod1Mask | Mod4Mask))) {
+        /* shortcuts are not typing; stays hidden until there is motion after a quiet period */
+        typing_deadline = get_time() + options.hide_while_typing * 1000LL;
+        if (highlight_visible) {
+            hide_highlight();
+            hidden_by_typing = 1;
+        }
+    }
+    if (pressed && options.show_keys) {
+        add_key_label(keycode);
+        keys_deadline = get_time() + KEYS_DISPLAY_TIME * 1000000LL;
+        request_frame();
+    }
+}
+
+/* advance critically damped spring towards (target, 0) by dt seconds, using its closed-form solution */
+static void step_spring(double* pos, double* vel, double target, double dt) {
+    double offset = *pos - target;
+    double decay = exp(-SMOOTH_FOLLOW_OMEGA * dt);
+    double c = *vel + SMOOTH_FOLLOW_OMEGA * offset;
+    *pos = target + (offset + c * dt) * decay;
+    *vel = (*vel - SMOOTH_FOLLOW_OMEGA * c * dt) * decay;
+}
+
+/* returns 1 if another frame is needed */
+static int update_smooth_follow(double dt) {
+    step_spring(&highlight_x, &velocity_x, pointer_x, dt);
+    step_spring(&highlight_y, &velocity_y, pointer_y, dt);
+    if (fabs(highlight_x - pointer_x) < 0.5 && fabs(highlight_y - pointer_y) < 0.5 && fabs(velocity_x) < 10 && fabs(velocity_y) < 10) {
+        highlight_x = pointer_x;
+        highlight_y = pointer_y;
+        velocity_x = 0;
+        velocity_y = 0;
+        move_highlight(pointer_x, pointer_y);
+        return 0;
+    }
+    move_highlight(lround(highlight_x), lround(highlight_y));
+    return 1;
+}
+
+/* returns 1 if another frame is needed */
+static int update_fade(double dt) {
+    double target = highlight_visible ? 1 : 0;
+    double step = dt * 1000 / options.fade;
+    if (fabs(target - opacity) <= step) {
+        set_opacity(target);
+        return 0;
+    }
+    set_opacity(opacity + (target > opacity ? step : -step));
+    return 1;
+}
+
+/* follows accelerated raw motion, so that the pointer does not need to be queried every frame */
+static void track_raw_motion(const XIRawEvent* raw) {
+    int d = raw->sourceid;
+    double value;
+    if (d < 0 || d >= MAX_DEVICES) {
+        return;
+    }
+    for (int k = 0; k < 2; ++k) {
+        double* p = k ? &tracked_y : &tracked_x;
+        int extent = k ? DisplayHeight(dpy, screen) : DisplayWidth(dpy, screen);
+        if (!get_valuator(raw, raw->valuators.values, k, &value)) {
+            continue;
+        }
+        if (devices[d].relative) {
+            *p += value;
+        } else if (devices[d].touch_valuators[k] >= 0) {
+            *p = (value - devices[d].touch_min[k]) / (devices[d].touch_max[k] - devices[d].touch_min[k]) * extent;
+        }
+        *p = *p < 0 ? 0 : *p > extent - 1 ? extent - 1 : *p;
+    }
+}
+
+/* queries the pointer at most once per sync interval */
+static void update_pointer_low_bandwidth(long long now) {
+    int x, y;
+    if (now - pointer_synced > LOW_BANDWIDTH_SYNC_INTERVAL) {
+        /* corrects drift, e.g. from warps, barriers, or absolute devices mapped to one monitor */
+        get_pointer_position(&x, &y);
+        tracked_x = x;
+        tracked_y = y;
+        pointer_synced = now;
+    } else {
+        x = lround(tracked_x);
+        y = lround(tracked_y);
+        record_trace(x, y);
+        add_heat(x, y);
+    }
+    if (abs(x - pointer_x) < LOW_BANDWIDTH_DEAD_ZONE && abs(y - pointer_y) < LOW_BANDWIDTH_DEAD_ZONE) {
+        return;
+    }
+    pointer_x = x;
+    pointer_y = y;
+    if (!options.smooth_follow) {
+        move_highlight(pointer_x, pointer_y);
+    }
+}
+
+/* bytes sent and received on the X connection, if it is a TCP connection */
+static int read_io_counters(long long* sent, long long* received) {
+#ifdef __linux__
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(ConnectionNumber(dpy), IPPROTO_TCP, TCP_INFO, &info, &len) || len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received)) {
+        return 1;
+    }
+    *sent = info.tcpi_bytes_acked;
+    *received = info.tcpi_bytes_received;
+    return 0;
+#else
+    (void)sent;
+    (void)received;
+    return 1;
+#endif
+}
+
+static void reset_stats(long long now) {
+    stats.time = now;
+    stats.requests = XNextRequest(dpy);
+    stats.bytes_sent = 0;
+    stats.bytes_received = 0;
+    read_io_counters(&stats.bytes_sent, &stats.bytes_received);
+    stats.wakeups = 0;
+    stats.events = 0;
+    stats.frames = 0;
+    memset(stats.jitter, 0, sizeof(stats.jitter));
+}
+
+static void add_jitter_sample(Time server_time, long long now) {
+    /* Time wraps around after 49 days, hence unsigned 32 bit arithmetic */
+    unsigned int offset = (unsigned int)(now / 1000) - (unsigned int)server_time;
+    if (!have_time_offset || (int)(offset - time_offset) < 0) {
+        time_offset = offset;
+        have_time_offset = 1;
+    }
+    unsigned int delay = offset - time_offset;
+    int bucket = 0;
+    while (bucket < JITTER_BUCKETS - 1 && delay >= 1u << bucket) {
+        ++bucket;
+    }
+    ++stats.jitter[bucket];
+}
+
+static void print_stats(long long now) {
+    double dt = (now - stats.time) / 1e6;
+    long long sent = 0, received = 0;
+    int have_io = !read_io_counters(&sent, &received);
+    fprintf(stderr, "stats: %.1f wakeups/s, %.1f events/s, %.1f frames/s, %.1f requests/s", stats.wakeups / dt, stats.events / dt, stats.frames / dt,
+            (XNextRequest(dpy) - stats.requests) / dt);
+    if (have_io) {
+        fprintf(stderr, ", %.0f bytes/s sent, %.0f bytes/s received", (sent - stats.bytes_sent) / dt, (received - stats.bytes_received) / dt);
+    }
+    fprintf(stderr, "\n");
+    if (have_time_offset) {
+        fprintf(stderr, "wakeup jitter:");
+        for (int i = 0; i < JITTER_BUCKETS - 1; ++i) {
+            fprintf(stderr, " %lu <%d ms,", stats.jitter[i], 1 << i);
+        }
+        fprintf(stderr, " %lu more\n", stats.jitter[JITTER_BUCKETS - 1]);
+    }
+    if (resources_created > 1) {
+        fprintf(stderr, "resources created %d times, last in %lld us\n", resources_created, resources_creation_time);
+    }
+    print_server_resources(stderr);
+    reset_stats(now);
+}
+
+static void handle_frame(long long now) {
+    double dt = (now - last_frame) / 1e6;
+    int more = 0;
+    if (dt > 2.0 / options.frame_rate) {
+        /* first frame after a pause */
+        dt = 1.0 / options.frame_rate;
+    }
+    last_frame = now;
+    frame_deadline = 0;
+    ++stats.frames;
+    if (pointer_dirty) {
+        pointer_dirty = 0;
+        if (highlight_visible) {
+            update_pointer_low_bandwidth(now);
+        }
+    }
+    if (options.smooth_follow && highlight_visible) {
+        more |= update_smooth_follow(dt);
+    }
+    if (scroll_intensity > 0 || scroll_amount[0] != 0 || scroll_amount[1] != 0) {
+        more |= update_scroll(dt);
+    }
+    if (keys_dirty) {
+        redraw_keys();
+    }
+    if (heatmap) {
+        more |= update_heatmap(now);
+    }
+    if (options.touch) {
+        update_touches();
+    }
+    if (options.gestures) {
+        update_gesture();
+    }
+    if (use_fade() && highlight_mapped && opacity != (highlight_visible ? 1 : 0)) {
+        more |= update_fade(dt);
+    }
+    if (more) {
+        request_frame();
+    }
+}
+
+static void handle_idle() {
+    if (options.auto_hide_cursor && cursor_visible) {
+        hide_cursor();
+    }
+    if (options.auto_hide_highlight && highlight_visible) {
+        hide_highlight();
+    }
+}
+
+static void raise_highlight(long long now) {
+    Window top = render_mode == RENDER_LAYER ? layer : win;
+    XRaiseWindow(dpy, top);
+    if (heatmap_win) {
+        /* right below, raising it above would obscure the highlight */
+        XWindowChanges changes;
+        changes.sibling = top;
+        changes.stack_mode = Below;
+        XConfigureWindow(dpy, heatmap_win, CWSibling | CWStackMode, &changes);
+    }
+    raise_history[raise_history_next] = now;
+    raise_history_next = (raise_history_next + 1) % RAISE_HISTORY_SIZE;
+}
+
+static void handle_obscured() {
+    long long now = get_time();
+    long long last = raise_history[(raise_history_next + RAISE_HISTORY_SIZE - 1) % RAISE_HISTORY_SIZE];
+    if (raise_deadline) {
+        /* coalesced into pending raise */
+        return;
+    }
+    if (raise_backoff) {
+        if (now - last > RAISE_STORM_WINDOW) {
+            raise_backoff = 0;
+        } else {
+            raise_backoff = 2 * raise_backoff < RAISE_BACKOFF_MAX ? 2 * raise_backoff : RAISE_BACKOFF_MAX;
+            raise_deadline = last + raise_backoff;
+            return;
+        }
+    } else if (now - raise_history[raise_history_next] < RAISE_STORM_WINDOW) {
+        /* RAISE_HISTORY_SIZE raises within the window, so another client keeps raising as well */
+        raise_backoff = RAISE_BACKOFF_MIN;
+        raise_deadline = now + raise_backoff;
+        return;
+    }
+    raise_highlight(now);
+}
+
+static void quit() { write(selfpipe[1], "", 1); }
+
+static void record_iteration(long long wake, long long deadline, unsigned int events, unsigned int requests, long long now) {
+    int i = flight_recorder_count++ % FLIGHT_RECORDER_SIZE;
+    flight_recorder[i].time = wake;
+    flight_recorder[i].late = deadline && wake > deadline ? wake - deadline : 0;
+    flight_recorder[i].duration = now - wake;
+    flight_recorder[i].events = events;
+    flight_recorder[i].requests = requests;
+}
+
+static void dump_flight_recorder(const char* reason, long long now) {
+    int fd = open(options.flight_recorder, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("Could not open flight recorder file");
+        return;
+    }
+    unsigned long start = flight_recorder_count > FLIGHT_RECORDER_SIZE ? flight_recorder_count - FLIGHT_RECORDER_SIZE : 0;
+    dprintf(fd, "# %s, %lu iterations\n# time_us late_us duration_us events requests\n", reason, flight_recorder_count - start);
+    for (unsigned long j = start; j < flight_recorder_count; ++j) {
+        int i = j % FLIGHT_RECORDER_SIZE;
+        dprintf(fd, "%lld %d %d %u %u\n", flight_recorder[i].time - now, flight_recorder[i].late, flight_recorder[i].duration, flight_recorder[i].events,
+                flight_recorder[i].requests);
+    }
+    close(fd);
+    last_flight_recorder_dump = now;
+    fprintf(stderr, "Flight recorder dumped to %s (%s)\n", options.flight_recorder, reason);
+}
+
+/* playback of a script or recorded trace through XTest, in steps of whole frames for reproducible timing */
+#define EASE_LINEAR 0
+#define EASE_IN 1
+#define EASE_OUT 2
+#define EASE_IN_OUT 3
+static const char* ease_names[] = {"linear", "ease-in", "ease-out", "ease-in-out"};
+
+static double ease(int easing, double t) {
+    switch (easing) {
+        case EASE_IN:
+            return t * t * t;
+        case EASE_OUT:
+            return 1 - (1 - t) * (1 - t) * (1 - t);
+        case EASE_IN_OUT:
+            return t < 0.5 ? 4 * t * t * t : 1 - 4 * (1 - t) * (1 - t) * (1 - t);
+        default:
+            return t;
+    }
+}
+
+static int add_keyframe(long long time, int x, int y, unsigned int keyframe_buttons, int easing) {
+    if (keyframe_count == keyframe_capacity) {
+        keyframe_capacity = keyframe_capacity ? 2 * keyframe_capacity : 256;
+        void* p = realloc(keyframes, keyframe_capacity * sizeof(*keyframes));
+        if (!p) {
+            fprintf(stderr, "Could not allocate playback\n");
+            return 1;
+        }
+        keyframes = p;
+    }
+    keyframes[keyframe_count].time = time;
+    keyframes[keyframe_count].x = x;
+    keyframes[keyframe_count].y = y;
+    keyframes[keyframe_count].buttons = keyframe_buttons;
+    keyframes[keyframe_count].easing = easing;
+    ++keyframe_count;
+    return 0;
+}
+
+/* lines are either trace samples "time_ms x y buttons" or script commands:
+     move X Y DURATION [EASING]   move within DURATION ms
+     wait DURATION
+     press BUTTON, release BUTTON, click BUTTON
+   and lines starting with '#' are comments */
+static int load_playback(const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        perror(filename);
+        return 1;
+    }
+    char line[256];
+    char command[16];
+    char easing_name[16];
+    int line_number = 0;
+    long long time = 0, trace_offset = -1;
+    int x = 0, y = 0;
+    unsigned int keyframe_buttons = 0;
+    get_pointer_position(&x, &y);
+    int res = add_keyframe(0, x, y, 0, EASE_LINEAR);
+    while (!res && fgets(line, sizeof(line), file)) {
+        long long t;
+        int a, b, n;
+        unsigned int c;
+        ++line_number;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "%lld %d %d %u", &t, &a, &b, &c) == 4) {
+            if (trace_offset < 0) {
+                trace_offset = t - time;
+            }
+            if (t - trace_offset < time) {
+                fprintf(stderr, "%s:%d: time going backwards\n", filename, line_number);
+                res = 1;
+                break;
+            }
+            time = t - trace_offset;
+            x = a;
+            y = b;
+            keyframe_buttons = c;
+            res = add_keyframe(time, x, y, keyframe_buttons, EASE_LINEAR);
+            continue;
+        }
+        n = sscanf(line, "%15s %d %d %lld %15s", command, &a, &b, &t, easing_name);
+        if (!strcmp(command, "move") && n >= 4 && t >= 0) {
+            int easing = EASE_IN_OUT;
+            if (n == 5) {
+                for (easing = 0; easing < 4 && strcmp(easing_name, ease_names[easing]); ++easing) {
+                }
+                if (easing == 4) {
+                    fprintf(stderr, "%s:%d: unknown easing %s\n", filename, line_number, easing_name);
+                    res = 1;
+                    break;
+                }
+            }
+            time += t;
+            x = a;
+            y = b;
+            res = add_keyframe(time, x, y, keyframe_buttons, easing);
+        } else if (!strcmp(command, "wait") && n == 2 && a >= 0) {
+            time += a;
+            res = add_keyframe(time, x, y, keyframe_buttons, EASE_LINEAR);
+        } else if ((!strcmp(command, "press") || !strcmp(command, "release") || !strcmp(command, "click")) && n == 2 && a > 0 && a < 32) {
+            if (command[0] != 'r') {
+                keyframe_buttons |= 1u << a;
+                res = add_keyframe(time, x, y, keyframe_buttons, EASE_LINEAR);
+            }
+            if (command[0] != 'p') {
+                keyframe_buttons &= ~(1u << a);
+                /* a frame later, so that press and release are seen separately */
+                time += 1000 / options.frame_rate;
+                res |= add_keyframe(time, x, y, keyframe_buttons, EASE_LINEAR);
+            }
+        } else {
+            fprintf(stderr, "%s:%d: invalid line\n", filename, line_number);
+            res = 1;
+        }
+    }
+    fclose(file);
+    return res;
+}
+
+static void step_playback() {
+    double time = playback_frame * 1000.0 / options.frame_rate; /* in ms */
+    int previous = playback_index;
+    while (playback_index + 1 < keyframe_count && keyframes[playback_index + 1].time <= time) {
+        ++playback_index;
+    }
+    /* button changes of all keyframes passed, in order */
+    unsigned int played_buttons = keyframes[previous].buttons;
+    for (int i = previous + 1; i <= playback_index; ++i) {
+        if (keyframes[i].buttons != played_buttons) {
+            XTestFakeMotionEvent(dpy, screen, keyframes[i].x, keyframes[i].y, CurrentTime);
+            for (int button = 1; button < 32; ++button) {
+                if ((keyframes[i].buttons ^ played_buttons) & (1u << button)) {
+                    XTestFakeButtonEvent(dpy, button, (keyframes[i].buttons >> button) & 1, CurrentTime);
+                }
+            }
+            played_buttons = keyframes[i].buttons;
+        }
+    }
+    if (playback_index + 1 >= keyframe_count) {
+        XTestFakeMotionEvent(dpy, screen, keyframes[playback_index].x, keyframes[playback_index].y, CurrentTime);
+        playback_deadline = 0;
+        quit();
+        return;
+    }
+    const struct keyframe* from = &keyframes[playback_index];
+    const struct keyframe* to = &keyframes[playback_index + 1];
+    double t = ease(to->easing, (double)(time - from->time) / (to->time - from->time));
+    XTestFakeMotionEvent(dpy, screen, lround(from->x + t * (to->x - from->x)), lround(from->y + t * (to->y - from->y)), CurrentTime);
+    ++playback_frame;
+    /* on a fixed grid from the start, so late frames do not shift the following ones */
+    playback_deadline = playback_start + playback_frame * 1000000LL / options.frame_rate;
+}
+
+static void handle_key(KeySym keysym, unsigned int modifiers) {
+    modifiers = modifiers & ~(numlockmask | LockMask);
+    int k;
+    for (k = 0; k < KEY_ARRAY_SIZE; ++k) {
+        if (keys[k].keysym == keysym && keys[k].modifiers == modifiers) {
+            break;
+        }
+    }
+    switch (k) {
+        case KEY_QUIT:
+            quit();
+            break;
+
+        case KEY_TOGGLE_CURSOR:
+            options.cursor_visible = 1 - options.cursor_visible;
+            if (options.cursor_visible && !cursor_visible) {
+                show_cursor();
+            } else if (!options.cursor_visible && cursor_visible) {
+                hide_cursor();
+            }
+            break;
+
+        case KEY_TOGGLE_HIGHLIGHT:
+            if (suspended) {
+                /* only takes effect when resuming */
+            } else if (options.highlight_visible) {
+                hide_highlight();
+            } else {
+                show_highlight();
+            }
+            options.highlight_visible = 1 - options.highlight_visible;
+            break;
+
+        case KEY_TOGGLE_AUTOHIDE_CURSOR:
+            options.auto_hide_cursor = 1 - options.auto_hide_cursor;
+            break;
+
+        case KEY_TOGGLE_AUTOHIDE_HIGHLIGHT:
+            options.auto_hide_highlight = 1 - options.auto_hide_highlight;
+            break;
+
+        case KEY_DUMP_FLIGHT_RECORDER:
+            if (options.flight_recorder) {
+                dump_flight_recorder("hotkey", get_time());
+            }
+            break;
+
+        case KEY_CYCLE_PRESET:
+            cycle_preset();
+            break;
+    }
+}
+
+static void handle_deadlines(long long now) {
+    if (frame_deadline && now >= frame_deadline) {
+        handle_frame(now);
+    }
+    if (idle_deadline && now >= idle_deadline) {
+        idle_deadline = 0;
+        handle_idle();
+    }
+    if (keys_deadline && now >= keys_deadline) {
+        keys_deadline = 0;
+        clear_keys();
+    }
+    if (typing_deadline && now >= typing_deadline) {
+        typing_deadline = 0;
+    }
+    if (raise_deadline && now >= raise_deadline) {
+        raise_deadline = 0;
+        if (highlight_mapped) {
+            raise_highlight(now);
+        }
+    }
+    if (playback_deadline && now >= playback_deadline) {
+        step_playback();
+    }
+    if (release_deadline && now >= release_deadline) {
+        release_deadline = 0;
+        release_resources();
+    }
+    if (stats_deadline && now >= stats_deadline) {
+        print_stats(now);
+        stats_deadline = now + options.stats_interval * 1000000LL;
+    }
+}
+
+static void handle_motion() {
+    if (options.auto_hide_cursor && options.cursor_visible && !cursor_visible) {
+        show_cursor();
+    }
+    if (hidden_by_typing) {
+        /* no position updates while hidden */
+        if (!typing_deadline && options.highlight_visible) {
+            show_highlight();
+        }
+    } else if ((options.auto_hide_highlight || !resources_ready) && options.highlight_visible && !highlight_visible) {
+        show_highlight();
+    } else if (highlight_visible && low_bandwidth) {
+        /* no synchronous request on the motion path */
+        pointer_dirty = 1;
+        request_frame();
+    } else if (highlight_visible) {
+        get_pointer_position(&pointer_x, &pointer_y);
+        if (options.smooth_follow) {
+            request_frame();
+        } else {
+            move_highlight(pointer_x, pointer_y);
+            /* unfortunately, this causes increase of the X server's cpu usage */
+        }
+    }
+}
+
+/* raw events other than motion and hierarchy changes */
+static void handle_raw_event(int evtype, const XIRawEvent* raw) {
+    switch (evtype) {
+        case XI_RawButtonPress:
+            if (raw->detail >= 4 && raw->detail <= 7) {
+                /* emulated from smooth scrolling, which is handled with the valuators */
+                if (!(raw->flags & XIPointerEmulated)) {
+                    add_scroll(raw->detail < 6 ? 0 : 1, raw->detail % 2 ? 1 : -1);
+                }
+            } else if (raw->detail > 0 && raw->detail < 32) {
+                buttons |= 1u << raw->detail;
+                record_trace(pointer_x, pointer_y);
+                update_state();
+            }
+            break;
+        case XI_RawButtonRelease:
+            if ((raw->detail < 4 || raw->detail > 7) && raw->detail > 0 && raw->detail < 32) {
+                buttons &= ~(1u << raw->detail);
+                record_trace(pointer_x, pointer_y);
+                update_state();
+            }
+            break;
+        case XI_RawKeyPress:
+            handle_raw_key(raw->detail, 1);
+            break;
+        case XI_RawKeyRelease:
+            handle_raw_key(raw->detail, 0);
+            break;
+        case XI_RawTouchBegin:
+        case XI_RawTouchUpdate:
+        case XI_RawTouchEnd:
+            handle_touch(evtype, raw);
+            break;
+    }
+}
+
+/* dispatches an event read from the connection */
+static void handle_event(XEvent* ev) {
+#if TARGET_FPS > 0
+    static Time lasttime = 0;
+#endif
+    if (ev->type == GenericEvent) {
+        XGenericEventCookie* cookie = &ev->xcookie;
+        long long now = get_time();
+        idle_deadline = now + (long long)options.hide_timeout * 1000000;
+        if (options.release_after) {
+            release_deadline = now + (long long)options.release_after * 1000000;
+        }
+        if (cookie->evtype == XI_RawMotion) {
+#if TARGET_FPS > 0
+            if (!XGetEventData(dpy, cookie)) {
+                return;
+            }
+            const XIRawEvent* data = (const XIRawEvent*)cookie->data;
+            if (data->time - lasttime <= 1000 / TARGET_FPS) {
+                XFreeEventData(dpy, cookie);
+                return;
+            }
+            lasttime = data->time;
+            XFreeEventData(dpy, cookie);
+#endif
+            if ((have_valuators || low_bandwidth || options.stats_interval > 0) && XGetEventData(dpy, cookie)) {
+                const XIRawEvent* raw = (const XIRawEvent*)cookie->data;
+                if (low_bandwidth) {
+                    track_raw_motion(raw);
+                }
+                int moved = !have_valuators || handle_valuators(raw);
+                if (options.stats_interval > 0) {
+                    add_jitter_sample(raw->time, now);
+                }
+                XFreeEventData(dpy, cookie);
+                if (!moved) {
+                    return;
+                }
+            }
+            handle_motion();
+            return;
+        }
+        if (cookie->evtype == XI_HierarchyChanged) {
+            init_devices();
+            return;
+        }
+        if (!XGetEventData(dpy, cookie)) {
+            return;
+        }
+        if (cookie->evtype >= XI_GesturePinchBegin && cookie->evtype <= XI_GestureSwipeEnd) {
+            handle_gesture(cookie->evtype, cookie->data);
+            XFreeEventData(dpy, cookie);
+            return;
+        }
+        handle_raw_event(cookie->evtype, (const XIRawEvent*)cookie->data);
+        if (options.stats_interval > 0) {
+            add_jitter_sample(((const XIRawEvent*)cookie->data)->time, now);
+        }
+        XFreeEventData(dpy, cookie);
+        return;
+    }
+
+    if (ev->type == KeyPress) {
+        KeySym keysym = XLookupKeysym(&ev->xkey, 0);
+        if (keysym != NoSymbol) {
+            handle_key(keysym, ev->xkey.state);
+        }
+        return;
+    }
+    if (ev->type == PropertyNotify) {
+        if (ev->xproperty.window == root && ev->xproperty.atom == active_window_atom) {
+            update_active_window();
+        } else if (ev->xproperty.window == active_window && ev->xproperty.atom == wm_state_atom && options.suspend_fullscreen) {
+            active_fullscreen = is_fullscreen(active_window);
+            update_suspend();
+        }
+        return;
+    }
+    if (ev->type == DestroyNotify) {
+        for (int i = 0; i < WM_CLASS_CACHE_SIZE; ++i) {
+            if (wm_class_cache[i].window == ev->xdestroywindow.window) {
+                wm_class_cache[i].window = None;
+            }
+        }
+        return;
+    }
+    if (ev->type == Expose && ev->xexpose.window == keys_win) {
+        if (ev->xexpose.count == 0 && keys_ring_count) {
+            XClearWindow(dpy, keys_win);
+            draw_keys();
+        }
+        return;
+    }
+    if (ev->type == Expose && ev->xexpose.window == heatmap_win) {
+        for (int t = 0; t < heatmap_tiles_x * heatmap_tiles_y; ++t) {
+            heatmap_tiles[t].dirty |= heatmap_tiles[t].active;
+        }
+        request_frame();
+        return;
+    }
+    if (ev->type == VisibilityNotify) {
+        /* needed to deal with menus, etc. overlapping the hightlight win */
+        if ((ev->xvisibility.window == win || ev->xvisibility.window == layer) && ev->xvisibility.state != VisibilityUnobscured) {
+            handle_obscured();
+        }
+    }
+}
+
+static void main_loop() {
+    XEvent ev;
+    fd_set fds;
+    int fd = ConnectionNumber(dpy);
+    struct timeval timeout;
+    struct timeval* timeout_p;
+    long long now, deadline;
+    long long wake = 0, wake_deadline = 0;
+    unsigned long events = 0, requests = 0;
+    int n;
+    char c;
+
+    pipe(selfpipe);
+    idle_deadline = get_time() + (long long)options.hide_timeout * 1000000;
+    if (options.stats_interval > 0) {
+        reset_stats(get_time());
+        stats_deadline = stats.time + options.stats_interval * 1000000LL;
+    }
+
+    while (1) {
+        now = get_time();
+        handle_deadlines(now);
+        XFlush(dpy);
+
+        if (wake) {
+            now = get_time();
+            long long woke = wake;
+            record_iteration(woke, wake_deadline, stats.events - events, XNextRequest(dpy) - requests, now);
+            if ((now - woke > options.stall_threshold * 1000LL || (wake_deadline && woke - wake_deadline > options.stall_threshold * 1000LL))
+                && now - last_flight_recorder_dump > FLIGHT_RECORDER_DUMP_INTERVAL * 1000000LL) {
+                dump_flight_recorder("stall", now);
+            }
+            wake = 0;
+        }
+
+        deadline = earliest(earliest(frame_deadline, idle_deadline), earliest(earliest(keys_deadline, typing_deadline), raise_deadline));
+        deadline = earliest(earliest(deadline, stats_deadline), earliest(release_deadline, playback_deadline));
+        wake_deadline = deadline;
+        if (XEventsQueued(dpy, QueuedAlready)) {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 0;
+            timeout_p = &timeout;
+        } else if (deadline) {
+            deadline -= now;
+            if (deadline < 0) {
+                deadline = 0;
+            }
+            timeout.tv_sec = deadline / 1000000;
+            timeout.tv_usec = deadline % 1000000;
+            timeout_p = &timeout;
+        } else {
+            timeout_p = NULL;
+        }
+
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        FD_SET(selfpipe[0], &fds);
+        n = select((fd > selfpipe[0] ? fd : selfpipe[0]) + 1, &fds, NULL, NULL, timeout_p);
+        if (n < 0) {
+            if (errno == EINTR) {
+                /* signals are handled through the self-pipe on the next select() */
+                continue;
+            }
+            perror("select() failed");
+            break;
+        }
+        if (n > 0 && FD_ISSET(selfpipe[0], &fds)) {
+            if (read(selfpipe[0], &c, 1) == 1 && c == 'd') {
+                dump_flight_recorder("signal", get_time());
+                continue;
+            }
+            break;
+        }
+        if (options.flight_recorder) {
+            wake = get_time();
+            events = stats.events;
+            requests = XNextRequest(dpy);
+        }
+        ++stats.wakeups;
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            ++stats.events;
+            handle_event(&ev);
+        }
+    }
+}
+
+static int init_colors() {
+    int res;
+
+    Colormap colormap = DefaultColormap(dpy, screen);
+
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        int level, levels;
+        int option = get_color_option(i, &level, &levels);
+        char* color_string = options.state_color_strings[option];
+        if (!color_string) {
+            if (option == STATE_RELEASED || option == STATE_CTRL || option == STATE_SHIFT) {
+                color_string = options.released_color_string;
+            } else {
+                color_string = options.pressed_color_string;
+            }
+        }
+        res = XAllocNamedColor(dpy, colormap, color_string, &states[i].color, &states[i].color);
+        if (!res) {
+            fprintf(stderr, "Can't allocate color: %s\n", color_string);
+            return 1;
+        }
+        if (level >= 0 && level < levels - 1) {
+            /* lower scroll intensities and pen pressures are blended towards the released color */
+            const XColor* from = &states[STATE_RELEASED].color;
+            XColor* to = &states[i].color;
+            double t = (level + 1.0) / levels;
+            to->red = from->red + t * (to->red - from->red);
+            to->green = from->green + t * (to->green - from->green);
+            to->blue = from->blue + t * (to->blue - from->blue);
+            if (!XAllocColor(dpy, colormap, to)) {
+                fprintf(stderr, "Can't allocate color: %s\n", color_string);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int grab_keys() {
+    /* after https://git.suckless.org/dwm/file/dwm.c.html */
+    numlockmask = 0;
+    unsigned int numlockkeycode = XKeysymToKeycode(dpy, XK_Num_Lock);
+    if (numlockkeycode) {
+        XModifierKeymap* modmap = XGetModifierMapping(dpy);
+        for (int i = 0; i < 8; ++i) {
+            for (int j = 0; j < modmap->max_keypermod; ++j) {
+                if (modmap->modifiermap[i * modmap->max_keypermod + j] == numlockkeycode) {
+                    numlockmask = (1 << i);
+                }
+            }
+        }
+        XFreeModifiermap(modmap);
+    }
+
+    unsigned int modifiers[] = {0, LockMask, numlockmask, numlockmask | LockMask};
+    for (int i = 0; i < KEY_ARRAY_SIZE; ++i) {
+        if (keys[i].keysym != NoSymbol) {
+            KeyCode c = XKeysymToKeycode(dpy, keys[i].keysym);
+            if (!c) {
+                fprintf(stderr, "Could not convert key to keycode\n");
+                return 1;
+            }
+            for (int j = 0; j < 2; ++j) {
+                XGrabKey(dpy, c, keys[i].modifiers | modifiers[j], root, 1, GrabModeAsync, GrabModeAsync);
+            }
+        }
+    }
+    return 0;
+}
+
+static void sig_handler(int sig) {
+    if (sig == SIGUSR2) {
+        write(selfpipe[1], "d", 1);
+        return;
+    }
+    quit();
+}
+
+static int parse_key(const char* s, int k) {
+    keys[k].modifiers = 0;
+
+    int i;
+    while (s[0] != '\0' && s[1] == '-') {
+        for (i = 0; i < KEY_MODMAP_SIZE; ++i) {
+            if (key_modifier_mapping[i].symbol == s[0]) {
+                keys[k].modifiers |= key_modifier_mapping[i].modifiers;
+                break;
+            }
+        }
+        if (i == KEY_MODMAP_SIZE) {
+            return 1;
+        }
+        s += 2;
+    }
+
+    keys[k].keysym = XStringToKeysym(s);
+    if (keys[k].keysym == NoSymbol) {
+        return 1;
+    }
+    return 0;
+}
+
+static void print_usage(const char* name) {
+    printf(
+        "Usage:\n"
+        "  %s [options]\n"
+        "\n"
+        "  -h, --help      show this help message\n"
+        "\n"
+        "DISPLAY OPTIONS\n"
+        "  -c, --released-color COLOR  dot color when mouse button released [default: #d62728]\n"
+        "  -p, --pressed-color COLOR   dot color when mouse button pressed [default: #1f77b4]\n"
+        "      --left-color COLOR      dot color when left button pressed or pen touching\n"
+        "                              [default: pressed color]\n"
+        "      --middle-color COLOR    dot color when middle button pressed [default: pressed color]\n"
+        "      --right-color COLOR     dot color when right button pressed [default: pressed color]\n"
+        "      --scroll-up-color COLOR    dot color when scrolling up/left [default: pressed color]\n"
+        "      --scroll-down-color COLOR  dot color when scrolling down/right [default: pressed color]\n"
+        "      --ctrl-color COLOR      dot color when ctrl key held [default: released color]\n"
+        "      --shift-color COLOR     dot color when shift key held [default: released color]\n"
+        "  -o, --outline OUTLINE       line width of outline or 0 for filled dot [default: 0]\n"
+        "  -r, --radius RADIUS         dot radius in pixels [default: 5]\n"
+        "      --style FILE            draw highlight from layers in FILE instead of a dot;\n"
+        "                              lines, from bottom to top, are\n"
+        "                                fill|ring|glow|shadow|image [radius=R] [width=W]\n"
+        "                                  [offset=X,Y] [alpha=A] [color=COLOR]\n"
+        "                                  [STATE=COLOR ...] [file=PNG|PAM]\n"
+        "                              with STATE a color option without \"-color\" and\n"
+        "                              COLOR \"state\" for the color of the state;\n"
+        "                              translucent if a compositor is running, else cut\n"
+        "                              to a shape at half opacity\n"
+        "      --image FILE            draw highlight from a PNG or PAM image, scaled to\n"
+        "                              the dot diameter, instead of a dot\n"
+        "      --preset FILE           style file, as for --style, to switch to with\n"
+        "                              --key-cycle-preset, can be given up to 8 times\n"
+        "      --overlay               draw into the Composite overlay window (or into a\n"
+        "                              screen-sized ARGB window if a compositor is running)\n"
+        "                              instead of moving a window\n"
+        "      --hide-highlight        start with highlighter hidden\n"
+        "      --show-cursor           start with cursor shown\n"
+        "      --smooth-follow         animate highlight towards pointer instead of jumping\n"
+        "      --touch                 highlight each finger on touchscreens\n"
+        "      --gestures              show fingers of touchpad pinch and swipe gestures\n"
+        "                              around the pointer (needs XInput 2.4)\n"
+        "      --heatmap               show where the pointer has been recently (needs a\n"
+        "                              compositing manager)\n"
+        "      --heatmap-decay DURATION\n"
+        "                              time constant of heatmap decay, in seconds [default: 10]\n"
+        "  -f, --frame-rate FPS        frame rate for animations [default: 60]\n"
+        "\n"
+        "PERFORMANCE OPTIONS\n"
+        "      --auto                  use the faster of moving a window and --overlay,\n"
+        "                              as measured on startup\n"
+        "      --cpu CPU               pin to CPU\n"
+        "      --compare-sprites DIR   compare highlight states as shown on screen with\n"
+        "                              images written by --dump-sprites to DIR, and quit\n"
+        "                              with failure if any differs\n"
+        "      --diagnose              print extension versions, compositor presence,\n"
+        "                              round-trip time, and render benchmark, and quit\n"
+        "      --dump-sprites DIR      write highlight states as shown on screen at the\n"
+        "                              top left corner as PAM images to DIR, and quit\n"
+        "      --flight-recorder FILE  record last 8192 loop iterations and append them to\n"
+        "                              FILE on SIGUSR2, hotkey, or stall\n"
+        "      --lazy                  create window and pixmaps only when first shown\n"
+        "      --low-bandwidth MODE    on, off, or auto for remote displays (TCP or slow\n"
+        "                              round trips): limit update rate, ignore small moves,\n"
+        "                              and track motion, querying pointer once a second [default: auto]\n"
+        "      --pixmap-cap SIZE       limit server pixmap memory of cached highlight\n"
+        "                              states to SIZE KiB by evicting least recently used\n"
+        "      --realtime              use real-time scheduling if permitted (else raise\n"
+        "                              priority) and lock memory; see --stats for wakeup\n"
+        "                              jitter\n"
+        "      --release-after TIMEOUT free server-side pixmaps, and window if hidden, when\n"
+        "                              idle for TIMEOUT seconds\n"
+        "      --stall-threshold DURATION\n"
+        "                              loop iteration duration or wakeup delay in ms that\n"
+        "                              dumps flight recorder [default: 100]\n"
+        "      --stats INTERVAL        print event, request, and TCP byte rates, wakeup\n"
+        "                              jitter, and server resources, every INTERVAL seconds\n"
+        "                              [default: 10 in low-bandwidth mode, else off]\n"
+#ifdef CHECK_ALLOCATIONS
+        "      --check-allocations ROUNDS  feed ROUNDS of synthetic input through the event\n"
+        "                              handlers and fail if any heap allocation happens\n"
+#endif
+        "\n"
+        "KEYSTROKE OPTIONS\n"
+        "      --show-keys             show pressed keys in an overlay\n"
+        "      --keys-font FONT        Xft font pattern for keys overlay [default: monospace:size=16]\n"
+        "      --keys-position POS     keys overlay position: bottom, top, or pointer [default: bottom]\n"
+        "\n"
+        "TIMEOUT OPTIONS\n"
+        "      --auto-hide-cursor      hide cursor when not moving after timeout\n"
+        "      --auto-hide-highlight   hide highlighter when not moving after timeout\n"
+        "  -t, --hide-timeout TIMEOUT  timeout for hiding when idle, in seconds [default: 3]\n"
+        "      --hide-while-typing DURATION\n"
+        "                              hide highlighter while typing until moved after\n"
+        "                              no key was pressed for DURATION milliseconds\n"
+        "  -F, --fade DURATION         fade highlight in/out when hiding, in milliseconds,\n"
+        "                              if a compositor is running, or 0 to disable [default: 0]\n"
+        "\n"
+        "SUSPEND OPTIONS\n"
+        "      --suspend-fullscreen    suspend while a fullscreen window is active\n"
+        "      --suspend-class CLASS   suspend while a window with WM_CLASS name or class CLASS\n"
+        "                              is active, can be given up to 8 times\n"
+        "\n"
+        "TRACE OPTIONS\n"
+        "      --record-trace FILE     record pointer positions and buttons to FILE\n"
+        "      --analyze TRACE         write click and dwell heatmaps of recorded TRACE to\n"
+        "                              TRACE.clicks.pgm and TRACE.dwell.pgm, and quit\n"
+        "      --blur RADIUS           standard deviation of heatmap blur in pixels [default: 16]\n"
+        "      --play FILE             move pointer and press buttons as in trace or script\n"
+        "                              FILE via XTest, one step per frame, and quit\n"
+        "                              when done; script lines are\n"
+        "                                move X Y DURATION [linear|ease-in|ease-out|ease-in-out]\n"
+        "                                wait DURATION\n"
+        "                                press|release|click BUTTON\n"
+        "                              with DURATION in milliseconds\n"
+        "\n"
+        "HOTKEY OPTIONS\n"
+        "      --key-quit KEY                        quit\n"
+        "      --key-toggle-cursor KEY               toggle cursor visibility\n"
+        "      --key-toggle-highlight KEY            toggle highlight visibility\n"
+        "      --key-toggle-auto-hide-cursor KEY     toggle auto-hiding cursor when not moving\n"
+        "      --key-toggle-auto-hide-highlight KEY  toggle auto-hiding highlight when not moving\n"
+        "      --key-dump-flight-recorder KEY        dump flight recorder\n"
+        "      --key-cycle-preset KEY                switch to next preset\n"
+        "\n"
+        "      Hotkeys are global and can only be used if not set yet by a different process.\n"
+        "      Keys can be given with modifiers\n"
+        "        'S' (shift key), 'C' (ctrl key), 'M' (alt/meta key), 'H' (super/\"windows\" key)\n"
+        "      delimited by a '-'.\n"
+        "      Keys themselves are parsed by X, so chars like a...z can be set directly,\n"
+        "      special keys are named as in /usr/include/X11/keysymdef.h\n"
+        "      or see, e.g. http://xahlee.info/linux/linux_show_keycode_keysym.html\n"
+        "\n"
+        "      Examples: 'H-Left', 'C-S-a'\n",
+        name);
+}
+
+static struct option long_options[] = {{"auto", no_argument, &options.auto_render, 1},
+                                       {"auto-hide-cursor", no_argument, &options.auto_hide_cursor, 1},
+                                       {"auto-hide-highlight", no_argument, &options.auto_hide_highlight, 1},
+                                       {"cpu", required_argument, NULL, 'C'},
+#ifdef CHECK_ALLOCATIONS
+                                       {"check-allocations", required_argument, NULL, 'A'},
+#endif
+                                       {"analyze", required_argument, NULL, 'Y'},
+                                       {"blur", required_argument, NULL, 'B'},
+                                       {"compare-sprites", required_argument, NULL, 'V'},
+                                       {"diagnose", no_argument, &options.diagnose, 1},
+                                       {"dump-sprites", required_argument, NULL, 'U'},
+                                       {"flight-recorder", required_argument, NULL, 'D'},
+                                       {"fade", required_argument, NULL, 'F'},
+                                       {"frame-rate", required_argument, NULL, 'f'},
+                                       {"help", no_argument, NULL, 'h'},
+                                       {"hide-highlight", no_argument, &options.highlight_visible, 0},
+                                       {"hide-timeout", required_argument, NULL, 't'},
+                                       {"hide-while-typing", required_argument, NULL, 'T'},
+                                       {"lazy", no_argument, &options.lazy, 1},
+                                       {"low-bandwidth", required_argument, NULL, 'L'},
+                                       {"outline", required_argument, NULL, 'o'},
+                                       {"overlay", no_argument, &options.overlay, 1},
+                                       {"pixmap-cap", required_argument, NULL, 'P'},
+                                       {"realtime", no_argument, &options.realtime, 1},
+                                       {"record-trace", required_argument, NULL, 'W'},
+                                       {"play", required_argument, NULL, 'Q'},
+                                       {"stall-threshold", required_argument, NULL, 'X'},
+                                       {"pressed-color", required_argument, NULL, 'p'},
+                                       {"radius", required_argument, NULL, 'r'},
+                                       {"release-after", required_argument, NULL, 'R'},
+                                       {"released-color", required_argument, NULL, 'c'},
+                                       {"left-color", required_argument, NULL, STATE_LEFT + COLOR_OPTION_OFFSET},
+                                       {"middle-color", required_argument, NULL, STATE_MIDDLE + COLOR_OPTION_OFFSET},
+                                       {"right-color", required_argument, NULL, STATE_RIGHT + COLOR_OPTION_OFFSET},
+                                       {"scroll-up-color", required_argument, NULL, STATE_SCROLL_UP + COLOR_OPTION_OFFSET},
+                                       {"scroll-down-color", required_argument, NULL, STATE_SCROLL_DOWN + COLOR_OPTION_OFFSET},
+                                       {"ctrl-color", required_argument, NULL, STATE_CTRL + COLOR_OPTION_OFFSET},
+                                       {"shift-color", required_argument, NULL, STATE_SHIFT + COLOR_OPTION_OFFSET},
+                                       {"keys-font", required_argument, NULL, 'k'},
+                                       {"keys-position", required_argument, NULL, 'K'},
+                                       {"show-cursor", no_argument, &options.cursor_visible, 1},
+                                       {"show-keys", no_argument, &options.show_keys, 1},
+                                       {"smooth-follow", no_argument, &options.smooth_follow, 1},
+                                       {"style", required_argument, NULL, 'G'},
+                                       {"preset", required_argument, NULL, 'E'},
+                                       {"image", required_argument, NULL, 'I'},
+                                       {"touch", no_argument, &options.touch, 1},
+                                       {"gestures", no_argument, &options.gestures, 1},
+                                       {"heatmap", no_argument, &options.heatmap, 1},
+                                       {"heatmap-decay", required_argument, NULL, 'H'},
+                                       {"stats", required_argument, NULL, 's'},
+                                       {"suspend-class", required_argument, NULL, 'S'},
+                                       {"suspend-fullscreen", no_argument, &options.suspend_fullscreen, 1},
+                                       {"key-quit", required_argument, NULL, KEY_QUIT + KEY_OPTION_OFFSET},
+                                       {"key-toggle-cursor", required_argument, NULL, KEY_TOGGLE_CURSOR + KEY_OPTION_OFFSET},
+                                       {"key-toggle-highlight", required_argument, NULL, KEY_TOGGLE_HIGHLIGHT + KEY_OPTION_OFFSET},
+                                       {"key-toggle-auto-hide-cursor", required_argument, NULL, KEY_TOGGLE_AUTOHIDE_CURSOR + KEY_OPTION_OFFSET},
+                                       {"key-toggle-auto-hide-highlight", required_argument, NULL, KEY_TOGGLE_AUTOHIDE_HIGHLIGHT + KEY_OPTION_OFFSET},
+                                       {"key-dump-flight-recorder", required_argument, NULL, KEY_DUMP_FLIGHT_RECORDER + KEY_OPTION_OFFSET},
+                                       {"key-cycle-preset", required_argument, NULL, KEY_CYCLE_PRESET + KEY_OPTION_OFFSET},
+                                       {NULL, 0, NULL, 0}};
+
+static int set_options(int argc, char* argv[]) {
+    options.auto_hide_cursor = 0;
+    options.auto_hide_highlight = 0;
+    options.cursor_visible = 0;
+    options.fade = 0;
+    options.frame_rate = 60;
+    options.highlight_visible = 1;
+    options.keys_font = "monospace:size=16";
+    options.keys_position = KEYS_POSITION_BOTTOM;
+    options.radius = 5;
+    options.outline = 0;
+    options.hide_timeout = 3;
+    options.auto_render = 0;
+    options.check_allocations = 0;
+    options.cpu = -1;
+    options.flight_recorder = NULL;
+    options.analyze = NULL;
+    options.blur = 16;
+    options.record_trace = NULL;
+    options.play = NULL;
+    options.style = NULL;
+    options.image = NULL;
+    options.dump_sprites = NULL;
+    options.compare_sprites = NULL;
+    options.stall_threshold = 100;
+    options.diagnose = 0;
+    options.heatmap = 0;
+    options.heatmap_decay = 10;
+    options.hide_while_typing = 0;
+    options.lazy = 0;
+    options.low_bandwidth = LOW_BANDWIDTH_AUTO;
+    options.overlay = 0;
+    options.pixmap_cap = 0;
+    options.realtime = 0;
+    options.release_after = 0;
+    options.stats_interval = 0;
+    options.pressed_color_string = "#1f77b4";
+    options.released_color_string = "#d62728";
+    options.show_keys = 0;
+    options.smooth_follow = 0;
+    options.touch = 0;
+    options.gestures = 0;
+    options.suspend_fullscreen = 0;
+    options.suspend_classes_count = 0;
+    options.preset_files_count = 0;
+
+    while (1) {
+        int c = getopt_long(argc, argv, "c:F:f:ho:p:r:t:", long_options, NULL);
+        if (c < 0) {
+            break;
+        }
+        if (c >= COLOR_OPTION_OFFSET && c < COLOR_OPTION_OFFSET + STATE_COUNT) {
+            options.state_color_strings[c - COLOR_OPTION_OFFSET] = optarg;
+            continue;
+        }
+        if (c >= KEY_OPTION_OFFSET && c < KEY_OPTION_OFFSET + KEY_ARRAY_SIZE) {
+            int res = parse_key(optarg, c - KEY_OPTION_OFFSET);
+            if (res) {
+                fprintf(stderr, "Could not parse key value %s\n", optarg);
+                return 1;
+            }
+            continue;
+        }
+        switch (c) {
+            case 0:
+                break;
+
+            case 'c':
+                options.released_color_string = optarg;
+                break;
+
+            case 'F':
+                options.fade = atoi(optarg);
+                if (options.fade < 0) {
+                    fprintf(stderr, "Invalid fade value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'f':
+                options.frame_rate = atoi(optarg);
+                if (options.frame_rate <= 0) {
+                    fprintf(stderr, "Invalid frame rate value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'h':
+                print_usage(argv[0]);
+                return -1;
+
+            case 'L':
+                if (strcmp(optarg, "auto") == 0) {
+                    options.low_bandwidth = LOW_BANDWIDTH_AUTO;
+                } else if (strcmp(optarg, "on") == 0) {
+                    options.low_bandwidth = 1;
+                } else if (strcmp(optarg, "off") == 0) {
+                    options.low_bandwidth = 0;
+                } else {
+                    fprintf(stderr, "Invalid low bandwidth value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'D':
+                options.flight_recorder = optarg;
+                break;
+
+            case 'Y':
+                options.analyze = optarg;
+                break;
+
+            case 'H':
+                options.heatmap_decay = atof(optarg);
+                if (options.heatmap_decay <= 0) {
+                    fprintf(stderr, "Invalid heatmap decay value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'B':
+                options.blur = atof(optarg);
+                if (options.blur <= 0) {
+                    fprintf(stderr, "Invalid blur value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'W':
+                options.record_trace = optarg;
+                break;
+
+            case 'Q':
+                options.play = optarg;
+                break;
+
+            case 'U':
+                options.dump_sprites = optarg;
+                break;
+
+            case 'V':
+                options.compare_sprites = optarg;
+                break;
+
+            case 'G':
+                options.style = optarg;
+                break;
+
+            case 'I':
+                options.image = optarg;
+                break;
+
+            case 'X':
+                options.stall_threshold = atoi(optarg);
+                if (options.stall_threshold <= 0) {
+                    fprintf(stderr, "Invalid stall threshold value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'C':
+                options.cpu = atoi(optarg);
+                if (options.cpu < 0 || options.cpu >= CPU_SETSIZE) {
+                    fprintf(stderr, "Invalid cpu value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'P':
+                options.pixmap_cap = atoi(optarg);
+                if (options.pixmap_cap <= 0) {
+                    fprintf(stderr, "Invalid pixmap cap value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+#ifdef CHECK_ALLOCATIONS
+            case 'A':
+                options.check_allocations = atoi(optarg);
+                if (options.check_allocations <= 0) {
+                    fprintf(stderr, "Invalid check allocations value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+#endif
+            case 'R':
+                options.release_after = atoi(optarg);
+                if (options.release_after <= 0) {
+                    fprintf(stderr, "Invalid release after value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 's':
+                options.stats_interval = atoi(optarg);
+                if (options.stats_interval <= 0) {
+                    fprintf(stderr, "Invalid stats interval value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'E':
+                if (options.preset_files_count == PRESETS_SIZE) {
+                    fprintf(stderr, "Too many presets\n");
+                    return 1;
+                }
+                options.preset_files[options.preset_files_count++] = optarg;
+                break;
+
+            case 'S':
+                if (options.suspend_classes_count == SUSPEND_CLASSES_SIZE) {
+                    fprintf(stderr, "Too many suspend classes\n");
+                    return 1;
+                }
+                options.suspend_classes[options.suspend_classes_count++] = optarg;
+                break;
+
+            case 'T':
+                options.hide_while_typing = atoi(optarg);
+                if (options.hide_while_typing <= 0) {
+                    fprintf(stderr, "Invalid hide while typing value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'k':
+                options.keys_font = optarg;
+                break;
+
+            case 'K':
+                if (strcmp(optarg, "bottom") == 0) {
+                    options.keys_position = KEYS_POSITION_BOTTOM;
+                } else if (strcmp(optarg, "top") == 0) {
+                    options.keys_position = KEYS_POSITION_TOP;
+                } else if (strcmp(optarg, "pointer") == 0) {
+                    options.keys_position = KEYS_POSITION_POINTER;
+                } else {
+                    fprintf(stderr, "Invalid keys position value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'o':
+                options.outline = atoi(optarg);
+                if (options.outline < 0) {
+                    fprintf(stderr, "Invalid outline value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'p':
+                options.pressed_color_string = optarg;
+                break;
+
+            case 'r':
+                options.radius = atoi(optarg);
+                if (options.radius <= 0) {
+                    fprintf(stderr, "Invalid radius value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 't':
+                options.hide_timeout = atoi(optarg);
+                if (options.hide_timeout <= 0) {
+                    fprintf(stderr, "Invalid timeout value %s\n", optarg);
+                    return 1;
+                }
+                break;
+
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (options.style && options.image) {
+        fprintf(stderr, "Only one of --style and --image can be given\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int xerror_handler(Display* dpy_p, XErrorEvent* err) {
+    if (err->request_code == 33 /* XGrabKey */ && err->error_code == BadAccess) {
+        fprintf(stderr, "Key combination already grabbed by a different process\n");
+        exit(1);
+    }
+    if (err->error_code == BadWindow && err->resourceid != win && err->resourceid != keys_win) {
+        /* active window may be destroyed before we deselect or query it */
+        return 0;
+    }
+    if (err->error_code == BadAtom) {
+        fprintf(stderr, "X warning: BadAtom for %d-%d\n", err->request_code, err->minor_code);
+        return 0;
+    }
+    char buf[1024];
+    XGetErrorText(dpy_p, err->error_code, buf, 1024);
+    fprintf(stderr, "X error: %s\n", buf);
+    exit(1);
+}
+
+/* average round-trip time to the X server, in microseconds */
+static long long measure_rtt(int n) {
+    long long start = get_time();
+    for (int i = 0; i < n; ++i) {
+        XSync(dpy, False);
+    }
+    return (get_time() - start) / n;
+}
+
+static int is_remote_display() {
+    const char* name = DisplayString(dpy);
+    const char* colon = strrchr(name, ':');
+    /* host part as in "localhost:10.0" for ssh -X or "host:0" for TCP */
+    if (colon && colon != name && strncmp(name, "unix:", 5) != 0 && name[0] != '/') {
+        return 1;
+    }
+    return measure_rtt(10) > LOW_BANDWIDTH_RTT;
+}
+
+#define BENCHMARK_UPDATES 200
+
+/* average time per highlight update off-screen, in microseconds, or -1 if mode does not work */
+static double benchmark_render(int mode) {
+    int total_radius = sprite_radius;
+    int x = -4 * total_radius;
+    int y = -4 * total_radius;
+    if (mode != RENDER_WINDOW && init_layer()) {
+        return -1;
+    }
+    current_state = STATE_RELEASED;
+    prepare_state(current_state);
+    if (mode == RENDER_WINDOW) {
+        XSetWindowBackgroundPixmap(dpy, win, states[current_state].pixmap);
+        move_highlight(x, y);
+        XMapWindow(dpy, win);
+    }
+    XSync(dpy, False);
+    long long start = get_time();
+    for (int i = 0; i < BENCHMARK_UPDATES; ++i) {
+        move_highlight(x - i % 2, y);
+    }
+    XSync(dpy, False);
+    double res = (double)(get_time() - start) / BENCHMARK_UPDATES;
+    if (mode == RENDER_WINDOW) {
+        XUnmapWindow(dpy, win);
+    } else {
+        free_layer();
+        render_mode = RENDER_WINDOW;
+        layer = None;
+        highlight_mapped = 0;
+        drawn = 0;
+    }
+    current_state = -1;
+    XSync(dpy, False);
+    return res;
+}
+
+static void print_extension_version(const char* name, int present, int major_version, int minor_version) {
+    if (present) {
+        printf("  %-12s %d.%d\n", name, major_version, minor_version);
+    } else {
+        printf("  %-12s not supported\n", name);
+    }
+}
+
+static void print_extension_presence(const char* name) {
+    int opcode, event, error;
+    printf("  %-12s %s\n", name, XQueryExtension(dpy, name, &opcode, &event, &error) ? "supported" : "not supported");
+}
+
+#define SPRITE_TOLERANCE 2 /* per channel, for --compare-sprites */
+
+static unsigned int get_channel(unsigned long pixel, unsigned long mask) {
+    if (!mask) {
+        return 0;
+    }
+    while (!(mask & 1)) {
+        pixel >>= 1;
+        mask >>= 1;
+    }
+    return (pixel & mask) * 255 / mask;
+}
+
+/* state as shown on screen, drawn at the top left corner and read back from the root window */
+static unsigned char* get_sprite(int i, int* size) {
+    Visual* visual = DefaultVisual(dpy, screen);
+    *size = 2 * sprite_radius + 2;
+    set_state(i);
+    highlight_visible = 1;
+    move_highlight(sprite_radius + 1, sprite_radius + 1);
+    if (render_mode == RENDER_WINDOW && !highlight_mapped) {
+        XMapRaised(dpy, win);
+        highlight_mapped = 1;
+    }
+    XSync(dpy, False);
+    XImage* image = XGetImage(dpy, root, 0, 0, *size, *size, AllPlanes, ZPixmap);
+    unsigned char* sprite = malloc(*size * *size * 4);
+    for (int y = 0; y < *size; ++y) {
+        for (int x = 0; x < *size; ++x) {
+            unsigned long pixel = XGetPixel(image, x, y);
+            unsigned char* p = &sprite[4 * (y * *size + x)];
+            p[0] = get_channel(pixel, visual->red_mask);
+            p[1] = get_channel(pixel, visual->green_mask);
+            p[2] = get_channel(pixel, visual->blue_mask);
+            p[3] = 255;
+        }
+    }
+    XDestroyImage(image);
+    return sprite;
+}
+static int dump_sprites(const char* dir) {
+    char filename[4096];
+    int size;
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        snprintf(filename, sizeof(filename), "%s/state-%02d.pam", dir, i);
+        FILE* file = fopen(filename, "wb");
+        if (!file) {
+            perror(filename);
+            return 1;
+        }
+        unsigned char* sprite = get_sprite(i, &size);
+        fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", size, size);
+        fwrite(sprite, 4, size * size, file);
+        free(sprite);
+        if (fclose(file)) {
+            perror(filename);
+            return 1;
+        }
+    }
+    printf("%d sprites of %dx%d written to %s\n", STATE_COUNT, size, size, dir);
+    return 0;
+}
+
+static int compare_sprites(const char* dir) {
+    char filename[4096];
+    int size, width, height, failed = 0;
+    for (int i = 0; i < STATE_COUNT; ++i) {
+        snprintf(filename, sizeof(filename), "%s/state-%02d.pam", dir, i);
+        FILE* file = fopen(filename, "rb");
+        if (!file) {
+            perror(filename);
+            return 1;
+        }
+        unsigned char* sprite = get_sprite(i, &size);
+        if (fscanf(file, "P7 WIDTH %d HEIGHT %d DEPTH 4 MAXVAL 255 TUPLTYPE RGB_ALPHA ENDHDR", &width, &height) != 2 || fgetc(file) != '\n') {
+            fprintf(stderr, "%s: not an RGB_ALPHA PAM image\n", filename);
+            failed = 1;
+        } else if (width != size || height != size) {
+            printf("state %2d: size %dx%d differs from %dx%d\n", i, size, size, width, height);
+            failed = 1;
+        } else {
+            int differing = 0;
+            unsigned char* golden = malloc(4 * size * size);
+            if (fread(golden, 4, size * size, file) != (size_t)(size * size)) {
+                fprintf(stderr, "%s: truncated\n", filename);
+                differing = 1;
+            } else {
+                for (int j = 0; j < size * size; ++j) {
+                    for (int c = 0; c < 4; ++c) {
+                        if (abs(golden[4 * j + c] - sprite[4 * j + c]) > SPRITE_TOLERANCE) {
+                            ++differing;
+                            break;
+                        }
+                    }
+                }
+            }
+            free(golden);
+            if (differing) {
+                printf("state %2d: %d pixels differ\n", i, differing);
+                failed = 1;
+            }
+        }
+        free(sprite);
+        fclose(file);
+    }
+    if (!failed) {
+        printf("%d sprites match %s\n", STATE_COUNT, dir);
+    }
+    return failed;
+}
+
+static void diagnose() {
+    int major_version, minor_version, present;
+
+    int remote = is_remote_display();
+    int effective = options.low_bandwidth == LOW_BANDWIDTH_AUTO ? remote : options.low_bandwidth;
+    printf("Display: %s (%s, low-bandwidth mode %s)\n", DisplayString(dpy), remote ? "remote" : "local", effective ? "on" : "off");
+    printf("Extensions:\n");
+    present = XShapeQueryVersion(dpy, &major_version, &minor_version);
+    print_extension_version("SHAPE", present, major_version, minor_version);
+    major_version = 2;
+    minor_version = 2;
+    present = XIQueryVersion(dpy, &major_version, &minor_version) == Success;
+    print_extension_version("XInput", present, major_version, minor_version);
+    present = XFixesQueryVersion(dpy, &major_version, &minor_version);
+    print_extension_version("XFIXES", present, major_version, minor_version);
+    present = XRenderQueryVersion(dpy, &major_version, &minor_version);
+    print_extension_version("RENDER", present, major_version, minor_version);
+    present = XCompositeQueryVersion(dpy, &major_version, &minor_version);
+    print_extension_version("Composite", present, major_version, minor_version);
+    print_extension_presence("RANDR");
+    print_extension_presence("Present");
+    printf("Compositor: %s\n", compositor ? "running" : "not running");
+
+    long long rtt = measure_rtt(100);
+    printf("Round-trip time: %lld us\n", rtt);
+
+    printf("Render strategies (per update):\n");
+    double t = benchmark_render(RENDER_WINDOW);
+    printf("  %-12s %.1f us\n", "window", t);
+    t = benchmark_render(compositor ? RENDER_LAYER : RENDER_OVERLAY);
+    if (t < 0) {
+        printf("  %-12s not available\n", compositor ? "layer" : "overlay");
+    } else {
+        printf("  %-12s %.1f us\n", compositor ? "layer" : "overlay", t);
+    }
+    print_server_resources(stdout);
+}
+
+static int init_realtime() {
+    if (options.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(options.cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+            perror("Could not pin to cpu");
+            return 1;
+        }
+    }
+    if (options.realtime) {
+        /* lowest real-time priority still preempts all normal processes */
+        struct sched_param param;
+        param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+        if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+            if (setpriority(PRIO_PROCESS, 0, REALTIME_NICE)) {
+                fprintf(stderr, "Could not use real-time scheduling or raise priority\n");
+            } else {
+                fprintf(stderr, "Real-time scheduling not permitted, using nice level %d\n", REALTIME_NICE);
+            }
+        }
+        /* Xlib allocates data for every generic event, so pages mapped later are locked as well */
+        if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+            perror("Could not lock memory");
+        }
+    }
+    return 0;
+}
+
+#ifdef CHECK_ALLOCATIONS
+/* each round moves, scrolls, clicks, and types, then reads real motion; the first round warms up caches and is not counted */
+static int check_allocations(int rounds) {
+    unsigned char mask[1];
+    double values[3] = {0, 0, 1};
+    XIRawEvent raw;
+    KeyCode key = XKeysymToKeycode(dpy, XK_a);
+    KeyCode shift = XKeysymToKeycode(dpy, XK_Shift_L);
+    struct timespec delay = {0, 2000000};
+    XEvent ev;
+    int event, error, major_version, minor_version;
+    int have_xtest = XTestQueryExtension(dpy, &event, &error, &major_version, &minor_version);
+    unsigned long read_events = 0, read_allocations = 0, read_frees = 0;
+
+    /* a device with a vertical scroll valuator */
+    memset(&raw, 0, sizeof(raw));
+    raw.sourceid = MAX_DEVICES - 1;
+    raw.valuators.mask = mask;
+    raw.valuators.mask_len = sizeof(mask);
+    raw.valuators.values = values;
+    raw.raw_values = values;
+    devices[raw.sourceid].scroll_valuators[0] = 2;
+    devices[raw.sourceid].scroll_increments[0] = 1;
+
+    for (int round = -1; round < rounds; ++round) {
+        counting_allocations = round >= 0;
+
+        mask[0] = 1 << 0 | 1 << 1;
+        values[0] = values[1] = round % 2 ? 1 : -1;
+        if (handle_valuators(&raw)) {
+            handle_motion();
+        }
+        mask[0] = 1 << 2;
+        handle_valuators(&raw);
+        for (int button = 1; button <= 4; ++button) {
+            raw.detail = button;
+            handle_raw_event(XI_RawButtonPress, &raw);
+            handle_raw_event(XI_RawButtonRelease, &raw);
+        }
+        raw.detail = shift;
+        handle_raw_event(XI_RawKeyPress, &raw);
+        raw.detail = key;
+        handle_raw_event(XI_RawKeyPress, &raw);
+        handle_raw_event(XI_RawKeyRelease, &raw);
+        raw.detail = shift;
+        handle_raw_event(XI_RawKeyRelease, &raw);
+        handle_deadlines(get_time());
+
+        /* Xlib allocates cookie data while reading generic events, counted separately */
+        if (have_xtest) {
+            XTestFakeRelativeMotionEvent(dpy, round % 2 ? 1 : -1, 0, CurrentTime);
+        }
+        unsigned long allocations = allocation_count, frees = free_count;
+        XSync(dpy, False);
+        while (XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            handle_event(&ev);
+            read_events += counting_allocations;
+        }
+        read_allocations += allocation_count - allocations;
+        read_frees += free_count - frees;
+        allocation_count = allocations;
+        free_count = frees;
+        counting_allocations = 0;
+        nanosleep(&delay, NULL);
+    }
+
+    printf("%d rounds of synthetic input: %lu allocations, %lu frees\n", rounds, allocation_count, free_count);
+    printf("%lu events read from the connection: %lu allocations, %lu frees\n", read_events, read_allocations, read_frees);
+    if (!have_xtest) {
+        fprintf(stderr, "XTest extension not supported, no motion generated\n");
+    }
+    return allocation_count || free_count ? 1 : 0;
+}
+#endif
+
+/* offline analysis of recorded traces into click and dwell heatmaps */
+#define ANALYZE_MAX_THREADS 16
+#define DWELL_CAP 1000 /* longest time counted at one position, in ms */
+
+struct trace_chunk {
+    const char* previous; /* last sample before begin, or NULL */
+    const char* begin;
+    const char* end;
+    int width;
+    int height;
+    unsigned int* clicks; /* shared by all chunks */
+    unsigned int* dwell;  /* in ms */
+    unsigned long samples;
+    unsigned long click_count;
+};
+
+struct blur_rows {
+    const float* in;
+    float* out;
+    int width;
+    int height;
+    const float* kernel;
+    int radius;
+    int y0;
+    int y1;
+};
+
+static const char* parse_number(const char* p, const char* end, long long* value) {
+    long long v = 0;
+    int negative = 0;
+    while (p < end && *p == ' ') {
+        ++p;
+    }
+    if (p < end && *p == '-') {
+        negative = 1;
+        ++p;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = 10 * v + (*p - '0');
+        ++p;
+    }
+    *value = negative ? -v : v;
+    return p;
+}
+
+static const char* next_line(const char* p, const char* end) {
+    const char* newline = memchr(p, '\n', end - p);
+    return newline ? newline + 1 : end;
+}
+
+/* start of the last sample line before p, or NULL */
+static const char* previous_sample(const char* data, const char* p) {
+    while (p > data) {
+        const char* line = p - 1;
+        while (line > data && line[-1] != '\n') {
+            --line;
+        }
+        if (*line != '#') {
+            return line;
+        }
+        p = line;
+    }
+    return NULL;
+}
+
+static void* accumulate_trace(void* arg) {
+    struct trace_chunk* chunk = (struct trace_chunk*)arg;
+    const char* p = chunk->begin;
+    long long t, x, y, b;
+    long long last_t = -1, last_x = -1, last_y = -1, last_b = 0;
+    if (chunk->previous) {
+        /* continues the previous chunk, so that held buttons are no clicks and no dwell time is lost */
+        const char* q = parse_number(chunk->previous, chunk->begin, &last_t);
+        q = parse_number(q, chunk->begin, &last_x);
+        q = parse_number(q, chunk->begin, &last_y);
+        parse_number(q, chunk->begin, &last_b);
+    }
+    while (p < chunk->end) {
+        if (*p == '#') {
+            p = next_line(p, chunk->end);
+            continue;
+        }
+        p = parse_number(p, chunk->end, &t);
+        p = parse_number(p, chunk->end, &x);
+        p = parse_number(p, chunk->end, &y);
+        p = parse_number(p, chunk->end, &b);
+        p = next_line(p, chunk->end);
+        if (last_t >= 0 && last_x >= 0 && last_x < chunk->width && last_y >= 0 && last_y < chunk->height && t > last_t) {
+            __atomic_fetch_add(&chunk->dwell[last_y * chunk->width + last_x], t - last_t < DWELL_CAP ? t - last_t : DWELL_CAP, __ATOMIC_RELAXED);
+        }
+        if (x >= 0 && x < chunk->width && y >= 0 && y < chunk->height && (b & ~last_b)) {
+            __atomic_fetch_add(&chunk->clicks[y * chunk->width + x], 1, __ATOMIC_RELAXED);
+            ++chunk->click_count;
+        }
+        ++chunk->samples;
+        last_t = t;
+        last_x = x;
+        last_y = y;
+        last_b = b;
+    }
+    return NULL;
+}
+
+/* vertical pass, four columns at a time; horizontal is done on the transpose */
+static void* blur_columns(void* arg) {
+    const struct blur_rows* task = (const struct blur_rows*)arg;
+    int width = task->width;
+    for (int y = task->y0; y < task->y1; ++y) {
+        int k0 = y - task->radius < 0 ? task->radius - y : 0;
+        int k1 = y + task->radius >= task->height ? task->radius + task->height - 1 - y : 2 * task->radius;
+        float* out = task->out + (size_t)y * width;
+        int x = 0;
+        for (; x + 4 <= width; x += 4) {
+            v4sf sum = {0, 0, 0, 0};
+            for (int k = k0; k <= k1; ++k) {
+                v4sf v;
+                memcpy(&v, task->in + (size_t)(y + k - task->radius) * width + x, sizeof(v));
+                sum += v * task->kernel[k];
+            }
+            memcpy(out + x, &sum, sizeof(sum));
+        }
+        for (; x < width; ++x) {
+            float sum = 0;
+            for (int k = k0; k <= k1; ++k) {
+                sum += task->in[(size_t)(y + k - task->radius) * width + x] * task->kernel[k];
             }
+            out[x] = sum;
         }
     }
-    return 0;
-}
-
-static void sig_handler(int sig) {
-    (void)sig;
-    quit();
+    return NULL;
 }
 
-static int parse_key(const char* s, int k) {
-    keys[k].modifiers = 0;
-
-    int i;
-    while (s[0] != '\0' && s[1] == '-') {
-        for (i = 0; i < KEY_MODMAP_SIZE; ++i) {
-            if (key_modifier_mapping[i].symbol == s[0]) {
-                keys[k].modifiers |= key_modifier_mapping[i].modifiers;
-                break;
+static void transpose(const float* in, float* out, int width, int height) {
+    for (int y0 = 0; y0 < height; y0 += 32) {
+        for (int x0 = 0; x0 < width; x0 += 32) {
+            for (int y = y0; y < y0 + 32 && y < height; ++y) {
+                for (int x = x0; x < x0 + 32 && x < width; ++x) {
+                    out[(size_t)x * height + y] = in[(size_t)y * width + x];
+                }
             }
         }
-        if (i == KEY_MODMAP_SIZE) {
-            return 1;
-        }
-        s += 2;
     }
+}
 
-    keys[k].keysym = XStringToKeysym(s);
-    if (keys[k].keysym == NoSymbol) {
-        return 1;
+static void blur_parallel(const float* in, float* out, int width, int height, const float* kernel, int radius, int threads) {
+    pthread_t thread[ANALYZE_MAX_THREADS];
+    struct blur_rows task[ANALYZE_MAX_THREADS];
+    for (int i = 0; i < threads; ++i) {
+        task[i].in = in;
+        task[i].out = out;
+        task[i].width = width;
+        task[i].height = height;
+        task[i].kernel = kernel;
+        task[i].radius = radius;
+        task[i].y0 = (long long)height * i / threads;
+        task[i].y1 = (long long)height * (i + 1) / threads;
+        pthread_create(&thread[i], NULL, blur_columns, &task[i]);
+    }
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(thread[i], NULL);
     }
-    return 0;
 }
 
-static void print_usage(const char* name) {
-    printf(
-        "Usage:\n"
-        "  %s [options]\n"
-        "\n"
-        "  -h, --help      show this help message\n"
-        "\n"
-        "DISPLAY OPTIONS\n"
-        "  -c, --released-color COLOR  dot color when mouse button released [default: #d62728]\n"
-        "  -p, --pressed-color COLOR   dot color when mouse button pressed [default: #1f77b4]\n"
-        "  -o, --outline OUTLINE       line width of outline or 0 for filled dot [default: 0]\n"
-        "  -r, --radius RADIUS         dot radius in pixels [default: 5]\n"
-        "      --hide-highlight        start with highlighter hidden\n"
-        "      --show-cursor           start with cursor shown\n"
-        "\n"
-        "TIMEOUT OPTIONS\n"
-        "      --auto-hide-cursor      hide cursor when not moving after timeout\n"
-        "      --auto-hide-highlight   hide highlighter when not moving after timeout\n"
-        "  -t, --hide-timeout TIMEOUT  timeout for hiding when idle, in seconds [default: 3]\n"
-        "\n"
-        "HOTKEY OPTIONS\n"
-        "      --key-quit KEY                        quit\n"
-        "      --key-toggle-cursor KEY               toggle cursor visibility\n"
-        "      --key-toggle-highlight KEY            toggle highlight visibility\n"
-        "      --key-toggle-auto-hide-cursor KEY     toggle auto-hiding cursor when not moving\n"
-        "      --key-toggle-auto-hide-highlight KEY  toggle auto-hiding highlight when not moving\n"
-        "\n"
-        "      Hotkeys are global and can only be used if not set yet by a different process.\n"
-        "      Keys can be given with modifiers\n"
-        "        'S' (shift key), 'C' (ctrl key), 'M' (alt/meta key), 'H' (super/\"windows\" key)\n"
-        "      delimited by a '-'.\n"
-        "      Keys themselves are parsed by X, so chars like a...z can be set directly,\n"
-        "      special keys are named as in /usr/include/X11/keysymdef.h\n"
-        "      or see, e.g. http://xahlee.info/linux/linux_show_keycode_keysym.html\n"
-        "\n"
-        "      Examples: 'H-Left', 'C-S-a'\n",
-        name);
+/* counts as floats, for blurring */
+static void to_grid(const unsigned int* counts, float* grid, size_t cells) {
+    for (size_t i = 0; i < cells; ++i) {
+        grid[i] = counts[i];
+    }
 }
 
-static struct option long_options[] = {{"auto-hide-cursor", no_argument, &options.auto_hide_cursor, 1},
-                                       {"auto-hide-highlight", no_argument, &options.auto_hide_highlight, 1},
-                                       {"help", no_argument, NULL, 'h'},
-                                       {"hide-highlight", no_argument, &options.highlight_visible, 0},
-                                       {"hide-timeout", required_argument, NULL, 't'},
-                                       {"outline", required_argument, NULL, 'o'},
-                                       {"pressed-color", required_argument, NULL, 'p'},
-                                       {"radius", required_argument, NULL, 'r'},
-                                       {"released-color", required_argument, NULL, 'c'},
-                                       {"show-cursor", no_argument, &options.cursor_visible, 1},
-                                       {"key-quit", required_argument, NULL, KEY_QUIT + KEY_OPTION_OFFSET},
-                                       {"key-toggle-cursor", required_argument, NULL, KEY_TOGGLE_CURSOR + KEY_OPTION_OFFSET},
-                                       {"key-toggle-highlight", required_argument, NULL, KEY_TOGGLE_HIGHLIGHT + KEY_OPTION_OFFSET},
-                                       {"key-toggle-auto-hide-cursor", required_argument, NULL, KEY_TOGGLE_AUTOHIDE_CURSOR + KEY_OPTION_OFFSET},
-                                       {"key-toggle-auto-hide-highlight", required_argument, NULL, KEY_TOGGLE_AUTOHIDE_HIGHLIGHT + KEY_OPTION_OFFSET},
-                                       {NULL, 0, NULL, 0}};
-
-static int set_options(int argc, char* argv[]) {
-    options.auto_hide_cursor = 0;
-    options.auto_hide_highlight = 0;
-    options.cursor_visible = 0;
-    options.highlight_visible = 1;
-    options.radius = 5;
-    options.outline = 0;
-    options.hide_timeout = 3;
-    options.pressed_color_string = "#1f77b4";
-    options.released_color_string = "#d62728";
+/* separable Gaussian, grid is blurred in place using tmp */
+static int blur(float* grid, float* tmp, int width, int height, int threads) {
+    int radius = ceil(3 * options.blur);
+    float* kernel = malloc((2 * radius + 1) * sizeof(float));
+    float total = 0;
+    if (!kernel) {
+        fprintf(stderr, "Could not allocate heatmap\n");
+        return 1;
+    }
+    for (int k = 0; k <= 2 * radius; ++k) {
+        kernel[k] = exp(-(k - radius) * (k - radius) / (2 * options.blur * options.blur));
+        total += kernel[k];
+    }
+    for (int k = 0; k <= 2 * radius; ++k) {
+        kernel[k] /= total;
+    }
+    blur_parallel(grid, tmp, width, height, kernel, radius, threads);
+    transpose(tmp, grid, width, height);
+    blur_parallel(grid, tmp, height, width, kernel, radius, threads);
+    transpose(tmp, grid, height, width);
+    free(kernel);
+    return 0;
+}
 
-    while (1) {
-        int c = getopt_long(argc, argv, "c:ho:p:r:t:", long_options, NULL);
-        if (c < 0) {
-            break;
+/* 16 bit binary PGM scaled to the maximum */
+static int write_pgm(const char* filename, const float* grid, int width, int height) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        perror(filename);
+        return 1;
+    }
+    float max = 0;
+    for (size_t i = 0; i < (size_t)width * height; ++i) {
+        if (grid[i] > max) {
+            max = grid[i];
         }
-        if (c >= KEY_OPTION_OFFSET && c < KEY_OPTION_OFFSET + KEY_ARRAY_SIZE) {
-            int res = parse_key(optarg, c - KEY_OPTION_OFFSET);
-            if (res) {
-                fprintf(stderr, "Could not parse key value %s\n", optarg);
-                return 1;
-            }
-            continue;
+    }
+    float scale = max > 0 ? 65535 / max : 0;
+    unsigned char* row = malloc(2 * width);
+    if (!row) {
+        fprintf(stderr, "Could not allocate heatmap\n");
+        fclose(file);
+        return 1;
+    }
+    fprintf(file, "P5\n%d %d\n65535\n", width, height);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            unsigned int v = grid[(size_t)y * width + x] * scale + 0.5f;
+            row[2 * x] = v >> 8;
+            row[2 * x + 1] = v & 0xff;
         }
-        switch (c) {
-            case 0:
-                break;
-
-            case 'c':
-                options.released_color_string = optarg;
-                break;
-
-            case 'h':
-                print_usage(argv[0]);
-                return -1;
-
-            case 'o':
-                options.outline = atoi(optarg);
-                if (options.outline < 0) {
-                    fprintf(stderr, "Invalid outline value %s\n", optarg);
-                    return 1;
-                }
-                break;
+        fwrite(row, 2, width, file);
+    }
+    free(row);
+    if (fclose(file)) {
+        perror(filename);
+        return 1;
+    }
+    return 0;
+}
 
-            case 'p':
-                options.pressed_color_string = optarg;
-                break;
+static int analyze_trace(const char* filename) {
+    long long start = get_time();
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        fprintf(stderr, "Could not read trace %s\n", filename);
+        close(fd);
+        return 1;
+    }
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(filename);
+        return 1;
+    }
+    const char* end = data + st.st_size;
+    madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
 
-            case 'r':
-                options.radius = atoi(optarg);
-                if (options.radius <= 0) {
-                    fprintf(stderr, "Invalid radius value %s\n", optarg);
-                    return 1;
-                }
-                break;
+    int width, height;
+    if (sscanf(data, "# highlight-pointer trace %dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+        fprintf(stderr, "Trace %s has no screen size header\n", filename);
+        munmap((void*)data, st.st_size);
+        return 1;
+    }
+    size_t cells = (size_t)width * height;
 
-            case 't':
-                options.hide_timeout = atoi(optarg);
-                if (options.hide_timeout <= 0) {
-                    fprintf(stderr, "Invalid timeout value %s\n", optarg);
-                    return 1;
-                }
-                break;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > ANALYZE_MAX_THREADS) {
+        threads = ANALYZE_MAX_THREADS;
+    }
 
-            default:
-                print_usage(argv[0]);
-                return 1;
+    /* each thread accumulates a chunk of whole lines into shared grids, with
+       atomic adds rather than a screen-sized copy per thread */
+    pthread_t thread[ANALYZE_MAX_THREADS];
+    struct trace_chunk chunk[ANALYZE_MAX_THREADS];
+    unsigned int* clicks = calloc(cells, sizeof(unsigned int));
+    unsigned int* dwell = calloc(cells, sizeof(unsigned int));
+    if (!clicks || !dwell) {
+        fprintf(stderr, "Could not allocate heatmap\n");
+        free(clicks);
+        free(dwell);
+        munmap((void*)data, st.st_size);
+        return 1;
+    }
+    const char* begin = data;
+    for (int i = 0; i < threads; ++i) {
+        chunk[i].previous = previous_sample(data, begin);
+        chunk[i].begin = begin;
+        chunk[i].end = i == threads - 1 ? end : next_line(data + st.st_size * (i + 1) / threads, end);
+        if (chunk[i].end < begin) {
+            chunk[i].end = begin;
         }
+        begin = chunk[i].end;
+        chunk[i].width = width;
+        chunk[i].height = height;
+        chunk[i].clicks = clicks;
+        chunk[i].dwell = dwell;
+        chunk[i].samples = 0;
+        chunk[i].click_count = 0;
+        pthread_create(&thread[i], NULL, accumulate_trace, &chunk[i]);
     }
-    return 0;
-}
-
-static int xerror_handler(Display* dpy_p, XErrorEvent* err) {
-    if (err->request_code == 33 /* XGrabKey */ && err->error_code == BadAccess) {
-        fprintf(stderr, "Key combination already grabbed by a different process\n");
-        exit(1);
+    unsigned long samples = 0, click_count = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(thread[i], NULL);
+        samples += chunk[i].samples;
+        click_count += chunk[i].click_count;
     }
-    if (err->error_code == BadAtom) {
-        fprintf(stderr, "X warning: BadAtom for %d-%d\n", err->request_code, err->minor_code);
-        return 0;
+    munmap((void*)data, st.st_size);
+
+    int res = 0;
+    size_t len = strlen(filename) + 16;
+    char* output = malloc(len);
+    float* grid = malloc(cells * sizeof(float));
+    float* tmp = malloc(cells * sizeof(float));
+    if (!output || !grid || !tmp) {
+        fprintf(stderr, "Could not allocate heatmap\n");
+        res = 1;
+    } else {
+        to_grid(clicks, grid, cells);
+        snprintf(output, len, "%s.clicks.pgm", filename);
+        res = blur(grid, tmp, width, height, threads) || write_pgm(output, grid, width, height);
+        if (!res) {
+            to_grid(dwell, grid, cells);
+            snprintf(output, len, "%s.dwell.pgm", filename);
+            res = blur(grid, tmp, width, height, threads) || write_pgm(output, grid, width, height);
+        }
     }
-    char buf[1024];
-    XGetErrorText(dpy_p, err->error_code, buf, 1024);
-    fprintf(stderr, "X error: %s\n", buf);
-    exit(1);
+    free(output);
+    free(grid);
+    free(tmp);
+    free(clicks);
+    free(dwell);
+
+    printf("%lu samples, %lu clicks, %dx%d, %d threads, %.2f s\n", samples, click_count, width, height, threads, (get_time() - start) / 1e6);
+    return res;
 }
 
 int main(int argc, char* argv[]) {
@@ -634,6 +4840,10 @@ int main(int argc, char* argv[]) {
         return res;
     }
 
+    if (options.analyze) {
+        return analyze_trace(options.analyze);
+    }
+
     dpy = XOpenDisplay(NULL); /* defaults to DISPLAY env var */
     if (!dpy) {
         fprintf(stderr, "Can't open display\n");
@@ -644,6 +4854,7 @@ int main(int argc, char* argv[]) {
     root = RootWindow(dpy, screen);
 
     int event, error, opcode;
+    xres_available = XResQueryExtension(dpy, &event, &error);
     if (!XShapeQueryExtension(dpy, &event, &error)) {
         fprintf(stderr, "XShape extension not supported\n");
         return 1;
@@ -655,7 +4866,7 @@ int main(int argc, char* argv[]) {
     }
 
     int major_version = 2;
-    int minor_version = 2;
+    int minor_version = options.gestures ? 4 : 2;
     res = XIQueryVersion(dpy, &major_version, &minor_version);
     if (res == BadRequest) {
         fprintf(stderr, "XInput2 extension version 2.2 not supported\n");
@@ -664,22 +4875,129 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "Can't query XInput version\n");
         return 1;
     }
+    if (options.gestures && major_version == 2 && minor_version < 4) {
+        fprintf(stderr, "XInput2 extension version 2.4 needed for gestures\n");
+        return 1;
+    }
 
-    res = init_window();
+    client_xid = XAllocID(dpy);
+    detect_compositor();
+    res = init_colors();
     if (res) {
         return res;
     }
 
+    sprite_radius = options.radius + options.outline;
+    if (options.style || options.image) {
+        res = (options.style ? load_style(options.style) : load_image_style(options.image)) || compile_style();
+        free_style_layers();
+        if (res) {
+            return res;
+        }
+        if (compositor) {
+            /* the ARGB layer keeps the alpha, a window shape would cut it at half opacity */
+            options.overlay = 1;
+        }
+    }
+
+    /* other modes need the resources right away */
+    if (!options.lazy || options.overlay || options.auto_render || options.diagnose || options.dump_sprites || options.compare_sprites || options.touch || options.gestures || options.preset_files_count) {
+        res = create_resources();
+        if (res) {
+            return res;
+        }
+    }
+
     res = init_events();
     if (res) {
         return res;
     }
 
-    res = init_colors();
-    if (res) {
+    if (options.diagnose) {
+        diagnose();
+        free_states();
+        XFreeGC(dpy, gc);
+        XDestroyWindow(dpy, win);
+        XCloseDisplay(dpy);
+        return 0;
+    }
+
+    if (options.auto_render && !((options.style || options.image) && compositor)) {
+        /* pick fastest strategy that works on this server */
+        double window_time = benchmark_render(RENDER_WINDOW);
+        double layer_time = benchmark_render(compositor ? RENDER_LAYER : RENDER_OVERLAY);
+        options.overlay = layer_time >= 0 && layer_time < window_time;
+    }
+
+    if (options.low_bandwidth == LOW_BANDWIDTH_AUTO) {
+        low_bandwidth = is_remote_display();
+    } else {
+        low_bandwidth = options.low_bandwidth;
+    }
+    if (low_bandwidth) {
+        if (options.frame_rate > LOW_BANDWIDTH_FPS) {
+            options.frame_rate = LOW_BANDWIDTH_FPS;
+        }
+        if (!options.stats_interval) {
+            options.stats_interval = 10;
+        }
+    }
+
+    if (options.overlay) {
+        res = init_layer();
+        if (res) {
+            return res;
+        }
+    }
+
+    if (options.dump_sprites || options.compare_sprites) {
+        /* after init_layer(), so that overlay and layer rendering are checked as well */
+        res = options.dump_sprites ? dump_sprites(options.dump_sprites) : compare_sprites(options.compare_sprites);
+        if (render_mode != RENDER_WINDOW) {
+            free_layer();
+        }
+        free_states();
+        XFreeGC(dpy, gc);
+        XDestroyWindow(dpy, win);
+        XCloseDisplay(dpy);
         return res;
     }
 
+    if (options.preset_files_count) {
+        res = build_presets();
+        if (res) {
+            return res;
+        }
+    }
+
+    if (options.heatmap) {
+        res = init_heatmap();
+        if (res) {
+            return res;
+        }
+    }
+
+    if (options.touch) {
+        res = init_touch();
+        if (res) {
+            return res;
+        }
+    }
+
+    if (options.gestures) {
+        res = init_gestures();
+        if (res) {
+            return res;
+        }
+    }
+
+    if (options.show_keys) {
+        res = init_keys();
+        if (res) {
+            return res;
+        }
+    }
+
     res = grab_keys();
     if (res) {
         return res;
@@ -688,7 +5006,8 @@ int main(int argc, char* argv[]) {
     XAllowEvents(dpy, SyncBoth, CurrentTime);
     XSync(dpy, False);
 
-    if (options.highlight_visible) {
+    /* lazily created resources are shown on first motion */
+    if (options.highlight_visible && resources_ready) {
         show_highlight();
     }
 
@@ -696,19 +5015,86 @@ int main(int argc, char* argv[]) {
         hide_cursor();
     }
 
+    if (options.suspend_fullscreen || options.suspend_classes_count) {
+        update_active_window();
+    }
+
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
+    if (options.flight_recorder) {
+        signal(SIGUSR2, sig_handler);
+    }
+
+    if (options.record_trace) {
+        trace = fopen(options.record_trace, "w");
+        if (!trace) {
+            perror(options.record_trace);
+            return 1;
+        }
+        /* no allocation when writing */
+        setvbuf(trace, trace_buffer, _IOFBF, sizeof(trace_buffer));
+        trace_start = get_time();
+        fprintf(trace, "# highlight-pointer trace %dx%d\n# time_ms x y buttons\n", DisplayWidth(dpy, screen), DisplayHeight(dpy, screen));
+    }
+
+    if (options.play) {
+        if (!XTestQueryExtension(dpy, &event, &error, &major_version, &minor_version)) {
+            fprintf(stderr, "XTest extension not supported\n");
+            return 1;
+        }
+        res = load_playback(options.play);
+        if (res) {
+            return res;
+        }
+        playback_start = get_time();
+        playback_deadline = playback_start;
+    }
 
+    res = init_realtime();
+    if (res) {
+        return res;
+    }
+
+#ifdef CHECK_ALLOCATIONS
+    if (options.check_allocations) {
+        res = check_allocations(options.check_allocations);
+    } else {
+        main_loop();
+    }
+#else
     main_loop();
+#endif
 
     if (!cursor_visible) {
         show_cursor();
     }
     XUngrabKey(dpy, AnyKey, AnyModifier, root);
-    XUnmapWindow(dpy, win);
-    XFreeGC(dpy, gc);
-    XDestroyWindow(dpy, win);
+    if (heatmap) {
+        free_heatmap();
+    }
+    if (options.touch) {
+        free_touch();
+    }
+    if (options.gestures) {
+        free_gestures();
+    }
+    free_inactive_presets(1);
+    if (render_mode != RENDER_WINDOW) {
+        free_layer();
+    }
+    if (options.show_keys) {
+        free_keys();
+    }
+    if (resources_ready) {
+        XUnmapWindow(dpy, win);
+        free_states();
+        XFreeGC(dpy, gc);
+        XDestroyWindow(dpy, win);
+    }
+    if (trace) {
+        fclose(trace);
+    }
     XCloseDisplay(dpy);
 
-    return 0;
+    return res;
 }
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs a command against a fresh Xvfb server, with a fixed depth and a
+# black root background, so that only what the command draws varies.
+
+tmp=$(mktemp -d) || exit 1
+Xvfb -displayfd 3 -screen 0 640x480x24 -br -nolisten tcp +extension Composite 3>"$tmp/display" 2>"$tmp/xvfb.log" &
+xvfb=$!
+trap 'kill $xvfb 2>/dev/null; rm -rf "$tmp"' EXIT
+for i in $(seq 50); do
+    [ -s "$tmp/display" ] && break
+    kill -0 $xvfb 2>/dev/null || break
+    sleep 0.1
+done
+if [ ! -s "$tmp/display" ]; then
+    echo "Xvfb did not start:" >&2
+    cat "$tmp/xvfb.log" >&2
+    exit 1
+fi
+DISPLAY=:$(cat "$tmp/display")
+export DISPLAY
+"$@"